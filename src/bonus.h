@@ -78,21 +78,21 @@ extern "C" {
 const score_t bonus_states[3][256] = {
 	{ 0 },
 	{
-		['/'] = SCORE_MATCH_SLASH,
-		['-'] = SCORE_MATCH_WORD,
-		['_'] = SCORE_MATCH_WORD,
-		[' '] = SCORE_MATCH_WORD,
-		['.'] = SCORE_MATCH_DOT,
+		['/'] = SCORE_CONSTANT(SCORE_MATCH_SLASH),
+		['-'] = SCORE_CONSTANT(SCORE_MATCH_WORD),
+		['_'] = SCORE_CONSTANT(SCORE_MATCH_WORD),
+		[' '] = SCORE_CONSTANT(SCORE_MATCH_WORD),
+		['.'] = SCORE_CONSTANT(SCORE_MATCH_DOT),
 	},
 	{
-		['/'] = SCORE_MATCH_SLASH,
-		['-'] = SCORE_MATCH_WORD,
-		['_'] = SCORE_MATCH_WORD,
-		[' '] = SCORE_MATCH_WORD,
-		['.'] = SCORE_MATCH_DOT,
+		['/'] = SCORE_CONSTANT(SCORE_MATCH_SLASH),
+		['-'] = SCORE_CONSTANT(SCORE_MATCH_WORD),
+		['_'] = SCORE_CONSTANT(SCORE_MATCH_WORD),
+		[' '] = SCORE_CONSTANT(SCORE_MATCH_WORD),
+		['.'] = SCORE_CONSTANT(SCORE_MATCH_DOT),
 
-		/* ['a' ... 'z'] = SCORE_MATCH_CAPITAL, */
-		ASSIGN_LOWER(SCORE_MATCH_CAPITAL)
+		/* ['a' ... 'z'] = SCORE_CONSTANT(SCORE_MATCH_CAPITAL), */
+		ASSIGN_LOWER(SCORE_CONSTANT(SCORE_MATCH_CAPITAL))
 	}
 };
 
@@ -4,6 +4,12 @@
 #include <pthread.h>
 #include <unistd.h>
 #include <errno.h>
+#include <float.h>
+#include <time.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "options.h"
 #include "choices.h"
@@ -15,16 +21,26 @@
 /* Initial size of choices array */
 #define INITIAL_CHOICE_CAPACITY 128
 
+/*
+ * How long (in ms) a search runs before showing the best results so far,
+ * and how often it does so after that.
+ */
+#define PROGRESS_INTERVAL 50
+
+/* Fewest candidates worth giving a thread of their own to prepare */
+#define PREPARE_SLICE_MIN 4096
+
+/* What's written by one thread is kept apart from what's used by others */
+#define CACHE_LINE 64
+#define CACHE_ALIGNED __attribute__((aligned(CACHE_LINE)))
+
 static int cmpchoice(const void *_idx1, const void *_idx2) {
 	const struct scored_result *a = _idx1;
 	const struct scored_result *b = _idx2;
 
 	if (a->score == b->score) {
-		/* To ensure a stable sort, we must also sort by the string
-		 * pointers. We can do this since we know all the strings are
-		 * from a contiguous memory segment (buffer in choices_t).
-		 */
-		if (a->str < b->str) {
+		/* To ensure a stable sort, ties go in the order read */
+		if (a->index < b->index) {
 			return -1;
 		} else {
 			return 1;
@@ -36,6 +52,86 @@ static int cmpchoice(const void *_idx1, const void *_idx2) {
 	}
 }
 
+/*
+ * Fewer results than this are sorted with qsort, as it's not worth
+ * counting digits for them.
+ */
+#define RADIX_SORT_MIN 1024
+
+/*
+ * A result's key: in unsigned order from the best score to the worst, and
+ * then by index.
+ */
+static uint64_t result_key(const struct scored_result *result) {
+	uint32_t key;
+#ifdef SCORE_FIXED_POINT
+	key = ~((uint32_t)result->score ^ UINT32_C(0x80000000));
+#else
+	/* Both zeros compare equal, so must have the same key */
+	float score = result->score == 0 ? 0 : result->score;
+
+	uint32_t bits;
+	memcpy(&bits, &score, sizeof(bits));
+	key = ~(bits >> 31 ? ~bits : bits | UINT32_C(1) << 31);
+#endif
+	return (uint64_t)key << 32 | result->index;
+}
+
+/*
+ * Put results in cmpchoice's order, with room for count more in spare.
+ * Longer lists are radix sorted by result_key, a byte at a time from the
+ * least significant. Bytes which are the same throughout are skipped, as
+ * are the index's if the results are already in its order.
+ */
+static void results_sort(struct scored_result *results, size_t count, struct scored_result *spare) {
+	/* Already in order, and results may be NULL when there are none */
+	if (count < 2)
+		return;
+
+	if (count < RADIX_SORT_MIN) {
+		qsort(results, count, sizeof(struct scored_result), cmpchoice);
+		return;
+	}
+
+	size_t histogram[8][256];
+	memset(histogram, 0, sizeof(histogram));
+
+	int in_order = 1;
+	for (size_t i = 0; i < count; i++) {
+		uint64_t key = result_key(&results[i]);
+		for (int d = 0; d < 8; d++)
+			histogram[d][(key >> (8 * d)) & 0xff]++;
+		if (i && results[i - 1].index > results[i].index)
+			in_order = 0;
+	}
+
+	struct scored_result *from = results, *to = spare;
+	for (int d = in_order ? 4 : 0; d < 8; d++) {
+		size_t *digit_counts = histogram[d];
+		size_t at = 0;
+		int skip = 0;
+		for (int b = 0; b < 256; b++) {
+			size_t n = digit_counts[b];
+			if (n == count)
+				skip = 1;
+			digit_counts[b] = at;
+			at += n;
+		}
+		if (skip)
+			continue;
+
+		for (size_t i = 0; i < count; i++)
+			to[digit_counts[(result_key(&from[i]) >> (8 * d)) & 0xff]++] = from[i];
+
+		struct scored_result *tmp = from;
+		from = to;
+		to = tmp;
+	}
+
+	if (from != results)
+		memcpy(results, from, count * sizeof(struct scored_result));
+}
+
 static void *safe_realloc(void *buffer, size_t size) {
 	buffer = realloc(buffer, size);
 	if (!buffer) {
@@ -46,6 +142,226 @@ static void *safe_realloc(void *buffer, size_t size) {
 	return buffer;
 }
 
+/*
+ * Work is split between worker_count workers: the calling thread, and a
+ * pool of threads which wait for more between times.
+ */
+struct worker_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	pthread_cond_t idle;
+
+	/* What the workers are to run, and how many threads are still at it */
+	void (*run)(void *data, unsigned int worker_num);
+	void *data;
+	unsigned long generation;
+	unsigned int running;
+	int stop;
+
+	unsigned int worker_count;
+	struct pool_thread *threads;
+
+	/* Kept for searches, from one to the next */
+	struct worker *workers;
+};
+
+static void workers_free(struct worker *workers, unsigned int count);
+
+struct pool_thread {
+	pthread_t thread_id;
+	struct worker_pool *pool;
+	unsigned int worker_num;
+};
+
+static void *pool_thread_main(void *data) {
+	struct pool_thread *thread = data;
+	struct worker_pool *pool = thread->pool;
+	unsigned long generation = 0;
+
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		while (pool->generation == generation && !pool->stop)
+			pthread_cond_wait(&pool->wake, &pool->lock);
+		if (pool->stop)
+			break;
+
+		generation = pool->generation;
+		void (*run)(void *, unsigned int) = pool->run;
+		void *run_data = pool->data;
+		pthread_mutex_unlock(&pool->lock);
+
+		run(run_data, thread->worker_num);
+
+		pthread_mutex_lock(&pool->lock);
+		if (!--pool->running)
+			pthread_cond_signal(&pool->idle);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+static void pool_destroy(struct worker_pool *pool) {
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = 1;
+	pthread_cond_broadcast(&pool->wake);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (unsigned int i = 1; i < pool->worker_count; i++) {
+		if ((errno = pthread_join(pool->threads[i].thread_id, NULL))) {
+			perror("pthread_join");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	pthread_cond_destroy(&pool->idle);
+	pthread_cond_destroy(&pool->wake);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->threads);
+	if (pool->workers)
+		workers_free(pool->workers, pool->worker_count);
+	free(pool->workers);
+	free(pool);
+}
+
+/* The pool, started the first time it's needed with worker_count workers */
+static struct worker_pool *choices_pool(choices_t *c) {
+	if (c->pool && c->pool->worker_count == c->worker_count)
+		return c->pool;
+	if (c->pool)
+		pool_destroy(c->pool);
+
+	struct worker_pool *pool = calloc(1, sizeof(struct worker_pool));
+	if (!pool || !(pool->threads = calloc(c->worker_count, sizeof(struct pool_thread)))) {
+		fprintf(stderr, "Error: Can't allocate memory\n");
+		abort();
+	}
+	if (pthread_mutex_init(&pool->lock, NULL) != 0 ||
+	    pthread_cond_init(&pool->wake, NULL) != 0 ||
+	    pthread_cond_init(&pool->idle, NULL) != 0) {
+		fprintf(stderr, "Error: pthread_mutex_init failed\n");
+		abort();
+	}
+	pool->worker_count = c->worker_count;
+
+	/* The calling thread is worker 0 */
+	for (unsigned int i = 1; i < pool->worker_count; i++) {
+		pool->threads[i].pool = pool;
+		pool->threads[i].worker_num = i;
+		if ((errno = pthread_create(&pool->threads[i].thread_id, NULL, &pool_thread_main, &pool->threads[i]))) {
+			perror("pthread_create");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	return c->pool = pool;
+}
+
+/* Run run(data, worker_num) for every worker, and wait for them all */
+static void pool_run(struct worker_pool *pool, void (*run)(void *, unsigned int), void *data) {
+	pthread_mutex_lock(&pool->lock);
+	pool->run = run;
+	pool->data = data;
+	pool->generation++;
+	pool->running = pool->worker_count - 1;
+	pthread_cond_broadcast(&pool->wake);
+	pthread_mutex_unlock(&pool->lock);
+
+	run(data, 0);
+
+	pthread_mutex_lock(&pool->lock);
+	while (pool->running)
+		pthread_cond_wait(&pool->idle, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+struct prepare_job {
+	choices_t *choices;
+	size_t start;
+	size_t count;
+	unsigned int slices;
+};
+
+static void choices_prepare_slice(choices_t *c, size_t start, size_t end) {
+	for (size_t i = start; i < end; i++) {
+		c->signatures[i] = match_prepare(c->strings[i], c->lengths[i], c->prepared + c->prepared_offsets[i]);
+	}
+}
+
+static void choices_prepare_worker(void *data, unsigned int worker_num) {
+	struct prepare_job *job = data;
+	if (worker_num >= job->slices)
+		return;
+
+	choices_prepare_slice(job->choices,
+			      job->start + job->count * worker_num / job->slices,
+			      job->start + job->count * (worker_num + 1) / job->slices);
+}
+
+/*
+ * Prepare any candidates added since the last time. Each can be prepared
+ * independently, so once they've been given space this is split between
+ * the workers.
+ */
+static void choices_prepare(choices_t *c) {
+	size_t start = c->prepared_count;
+	if (start == c->size)
+		return;
+
+	size_t size = c->prepared_size;
+	for (size_t i = start; i < c->size; i++) {
+		c->prepared_offsets[i] = size;
+		size += MATCH_PREPARED_SIZE(c->lengths[i]);
+	}
+	c->prepared = safe_realloc(c->prepared, size);
+	c->prepared_size = size;
+
+	size_t count = c->size - start;
+	unsigned int slices = c->worker_count;
+	if (count / PREPARE_SLICE_MIN < slices)
+		slices = count / PREPARE_SLICE_MIN;
+
+	if (slices < 2) {
+		choices_prepare_slice(c, start, c->size);
+	} else {
+		struct prepare_job job = {.choices = c, .start = start, .count = count, .slices = slices};
+		pool_run(choices_pool(c), &choices_prepare_worker, &job);
+	}
+
+	c->prepared_count = c->size;
+}
+
+static void choices_resize(choices_t *c, size_t new_capacity) {
+	c->strings = safe_realloc(c->strings, new_capacity * sizeof(const char *));
+	c->lengths = safe_realloc(c->lengths, new_capacity * sizeof(size_t));
+	c->prepared_offsets = safe_realloc(c->prepared_offsets, new_capacity * sizeof(size_t));
+	c->signatures = safe_realloc(c->signatures, new_capacity * sizeof(uint64_t));
+	c->capacity = new_capacity;
+}
+
+static void choices_reset_search(choices_t *c) {
+	free(c->results);
+	c->selection = c->available = c->sorted = c->scored = 0;
+	c->results = NULL;
+}
+
+/*
+ * Adds a candidate without touching the results, which stay those of the last
+ * search over the candidates before it.
+ */
+static void choices_append(choices_t *c, const char *choice, size_t len) {
+	if (c->size == CHOICES_MAX) {
+		fprintf(stderr, "Error: Too many choices\n");
+		abort();
+	}
+
+	if (c->size == c->capacity) {
+		choices_resize(c, c->capacity * 2);
+	}
+	c->strings[c->size] = choice;
+	c->lengths[c->size++] = len;
+}
+
 void choices_fread(choices_t *c, FILE *file, char input_delimiter) {
 	/* Save current position for parsing later */
 	size_t buffer_start = c->buffer_size;
@@ -85,22 +401,333 @@ void choices_fread(choices_t *c, FILE *file, char input_delimiter) {
 
 		line = nl;
 	} while (line && line < line_end);
+
+	choices_prepare(c);
 }
 
-static void choices_resize(choices_t *c, size_t new_capacity) {
-	c->strings = safe_realloc(c->strings, new_capacity * sizeof(const char *));
-	c->capacity = new_capacity;
+static double now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
 }
 
-static void choices_reset_search(choices_t *c) {
-	free(c->results);
-	c->selection = c->available = 0;
-	c->results = NULL;
+/*
+ * Reads fd in place if it's a regular file, by mapping it rather than copying
+ * it. Candidates are then left as they are in the file, without NULs after
+ * them (see choices_getlen). Returns 0, having read nothing, if it can't.
+ */
+int choices_map(choices_t *c, int fd, char input_delimiter) {
+	struct stat st;
+	if (c->map || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || (uintmax_t)st.st_size > SIZE_MAX)
+		return 0;
+
+	/* Start wherever fd has got to, as reading it would */
+	off_t offset = lseek(fd, 0, SEEK_CUR);
+	if (offset < 0 || offset > st.st_size)
+		return 0;
+
+	size_t size = st.st_size;
+	if (size) {
+		char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map == MAP_FAILED)
+			return 0;
+
+		/* These are only hints, so it doesn't matter if they're ignored */
+		madvise(map, size, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+		madvise(map, size, MADV_HUGEPAGE);
+#endif
+		c->map = map;
+		c->map_size = size;
+	}
+
+	choices_reset_search(c);
+
+	/*
+	 * Tokenize input, skipping empty lines. A line is cut short at any NUL
+	 * in it, as it is when read, so that it's as long as its prepared row.
+	 */
+	const char *end = (const char *)c->map + size;
+	const char *line = (const char *)c->map + offset;
+	while (line < end) {
+		const char *nl = memchr(line, input_delimiter, end - line);
+		if (!nl)
+			nl = end;
+		size_t len = strnlen(line, nl - line);
+		if (len)
+			choices_append(c, line, len);
+		line = nl + 1;
+	}
+
+	choices_prepare(c);
+	return 1;
+}
+
+/* Size of the chunks which input read in the background goes into */
+#define READ_CHUNK_SIZE (64 << 10)
+
+/*
+ * Input is read in the background into chunks which never move, so that the
+ * candidates in them can be added as soon as they're complete. A candidate
+ * left incomplete at the end of a chunk is carried over to the next.
+ */
+struct input_chunk {
+	struct input_chunk *next;
+	size_t capacity;
+	char data[];
+};
+
+struct choices_reader {
+	pthread_t thread;
+	int fd;
+	char delimiter;
+
+	/* Gets a byte written to it whenever there's something to collect */
+	int signal[2];
+
+	/* Owned by the thread until it's joined */
+	struct input_chunk *chunks;
+	const char **scratch;
+	size_t scratch_capacity;
+
+	pthread_mutex_t lock;
+	const char **lines;
+	size_t count;
+	size_t capacity;
+	int signalled;
+	int done;
+
+	/* Whether all input has been added (only used by choices_stream_*) */
+	int finished;
+};
+
+/* Hands lines[0..count) to whoever collects them, and says when that's all */
+static void reader_publish(struct choices_reader *r, const char **lines, size_t count, int done) {
+	int cancel_state;
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cancel_state);
+	pthread_mutex_lock(&r->lock);
+
+	if (r->count + count > r->capacity) {
+		size_t capacity = r->capacity ? r->capacity : INITIAL_CHOICE_CAPACITY;
+		while (capacity < r->count + count)
+			capacity *= 2;
+		r->lines = safe_realloc(r->lines, capacity * sizeof(const char *));
+		r->capacity = capacity;
+	}
+	if (count)
+		memcpy(r->lines + r->count, lines, count * sizeof(const char *));
+	r->count += count;
+	r->done = done;
+
+	if (!r->signalled && (r->count || done)) {
+		r->signalled = 1;
+		while (write(r->signal[1], "", 1) < 0 && errno == EINTR)
+			;
+	}
+
+	pthread_mutex_unlock(&r->lock);
+	pthread_setcancelstate(cancel_state, NULL);
+}
+
+static void *reader_main(void *data) {
+	struct choices_reader *r = data;
+	struct input_chunk *chunk = NULL;
+	size_t used = 0;
+	size_t line_start = 0;
+
+	for (;;) {
+		/* The last byte of each chunk is kept for ending its last line */
+		if (!chunk || used == chunk->capacity - 1) {
+			size_t tail = chunk ? used - line_start : 0;
+			size_t capacity = READ_CHUNK_SIZE;
+			while (capacity <= 2 * tail)
+				capacity *= 2;
+
+			struct input_chunk *next = malloc(sizeof(struct input_chunk) + capacity);
+			if (!next) {
+				fprintf(stderr, "Error: Can't allocate memory\n");
+				abort();
+			}
+			next->capacity = capacity;
+			if (tail)
+				memcpy(next->data, chunk->data + line_start, tail);
+			next->next = r->chunks;
+			r->chunks = chunk = next;
+			used = tail;
+			line_start = 0;
+		}
+
+		ssize_t n = read(r->fd, chunk->data + used, chunk->capacity - 1 - used);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+
+		/* Tokenize what's complete, leaving the rest for the next read */
+		size_t count = 0;
+		char *end = chunk->data + used + n;
+		char *line = chunk->data + line_start;
+		char *nl;
+		while ((nl = memchr(line, r->delimiter, end - line))) {
+			*nl = '\0';
+
+			/* Skip empty lines */
+			if (nl > line) {
+				if (count == r->scratch_capacity) {
+					r->scratch_capacity = count ? count * 2 : INITIAL_CHOICE_CAPACITY;
+					r->scratch = safe_realloc(r->scratch, r->scratch_capacity * sizeof(const char *));
+				}
+				r->scratch[count++] = line;
+			}
+			line = nl + 1;
+		}
+		used += n;
+		line_start = line - chunk->data;
+
+		if (count)
+			reader_publish(r, r->scratch, count, 0);
+	}
+
+	const char *last = NULL;
+	if (chunk && used > line_start) {
+		chunk->data[used] = '\0';
+		last = chunk->data + line_start;
+	}
+	reader_publish(r, &last, last ? 1 : 0, 1);
+	return NULL;
+}
+
+/*
+ * Starts reading fd in the background. What's been read is added by
+ * choices_stream_update, which is worth calling whenever choices_stream_fd is
+ * ready to read. That's -1 once all of it has been added.
+ */
+void choices_stream(choices_t *c, int fd, char input_delimiter) {
+	struct choices_reader *r = malloc(sizeof(struct choices_reader));
+	if (!r) {
+		fprintf(stderr, "Error: Can't allocate memory\n");
+		abort();
+	}
+	r->fd = fd;
+	r->delimiter = input_delimiter;
+	r->chunks = NULL;
+	r->scratch = NULL;
+	r->scratch_capacity = 0;
+	r->lines = NULL;
+	r->count = r->capacity = 0;
+	r->signalled = r->done = r->finished = 0;
+
+	if (pipe(r->signal) < 0) {
+		perror("pipe");
+		exit(EXIT_FAILURE);
+	}
+	pthread_mutex_init(&r->lock, NULL);
+	if (pthread_create(&r->thread, NULL, &reader_main, r) != 0) {
+		fprintf(stderr, "Error: pthread_create failed\n");
+		abort();
+	}
+	c->reader = r;
+}
+
+int choices_stream_fd(const choices_t *c) {
+	if (!c->reader || c->reader->finished)
+		return -1;
+	return c->reader->signal[0];
+}
+
+/*
+ * Adds what's been read so far, returning whether that changed anything. The
+ * results are left as they were until the next search.
+ */
+int choices_stream_update(choices_t *c) {
+	struct choices_reader *r = c->reader;
+	if (!r || r->finished)
+		return 0;
+
+	pthread_mutex_lock(&r->lock);
+	const char **lines = r->lines;
+	size_t count = r->count;
+	r->lines = NULL;
+	r->count = r->capacity = 0;
+	if (r->signalled) {
+		char byte;
+		while (read(r->signal[0], &byte, 1) < 0 && errno == EINTR)
+			;
+		r->signalled = 0;
+	}
+	r->finished = r->done;
+	pthread_mutex_unlock(&r->lock);
+
+	for (size_t i = 0; i < count; i++)
+		choices_append(c, lines[i], strlen(lines[i]));
+	free(lines);
+
+	choices_prepare(c);
+	return count || r->finished;
+}
+
+/*
+ * Adds input until there's count candidates, it's all added or timeout ms pass
+ * (if timeout isn't negative).
+ */
+void choices_stream_wait(choices_t *c, size_t count, long int timeout) {
+	double deadline = now_ms() + timeout;
+	while (c->size < count && choices_stream_fd(c) >= 0) {
+		int left = -1;
+		if (timeout >= 0) {
+			double now = now_ms();
+			if (now >= deadline)
+				break;
+			left = (int)(deadline - now) + 1;
+		}
+
+		struct pollfd pfd = {.fd = choices_stream_fd(c), .events = POLLIN};
+		if (poll(&pfd, 1, left) > 0)
+			choices_stream_update(c);
+	}
+}
+
+static void reader_destroy(struct choices_reader *r) {
+	pthread_cancel(r->thread);
+	pthread_join(r->thread, NULL);
+
+	while (r->chunks) {
+		struct input_chunk *next = r->chunks->next;
+		free(r->chunks);
+		r->chunks = next;
+	}
+	free(r->scratch);
+	free(r->lines);
+	close(r->signal[0]);
+	close(r->signal[1]);
+	pthread_mutex_destroy(&r->lock);
+	free(r);
 }
 
 void choices_init(choices_t *c, options_t *options) {
 	c->strings = NULL;
+	c->lengths = NULL;
+	c->map = NULL;
+	c->map_size = 0;
 	c->results = NULL;
+	c->search = NULL;
+	c->searched = c->search_count = c->search_found = 0;
+	c->matched = NULL;
+	c->matched_count = c->matched_size = 0;
+	c->matched_rows = NULL;
+	c->rows = c->rows_spare = NULL;
+	c->pool = NULL;
+	c->cache_count = c->cache_bytes = 0;
+	c->cache_clock = 0;
+	c->partial_search = NULL;
+	c->partial = NULL;
+	c->partial_count = c->partial_size = 0;
+	c->reader = NULL;
+
+	c->prepared = NULL;
+	c->prepared_size = c->prepared_count = 0;
+	c->prepared_offsets = NULL;
+	c->signatures = NULL;
 
 	c->buffer_size = 0;
 	c->buffer = NULL;
@@ -114,214 +741,1395 @@ void choices_init(choices_t *c, options_t *options) {
 		c->worker_count = (int)sysconf(_SC_NPROCESSORS_ONLN);
 	}
 
+	/*
+	 * Printing matches needs them all in order. The interactive interface
+	 * (which --benchmark measures) only shows a screenful at a time.
+	 */
+	if (options->filter && !options->benchmark) {
+		c->limit = 0;
+	} else {
+		c->limit = options->num_lines;
+	}
+
+	/* Only typing extends a search by a character at a time */
+	c->extend_searches = !options->filter;
+
 	choices_reset_search(c);
 }
 
 void choices_destroy(choices_t *c) {
+	if (c->reader)
+		reader_destroy(c->reader);
+	c->reader = NULL;
+
 	free(c->buffer);
 	c->buffer = NULL;
 	c->buffer_size = 0;
 
 	free(c->strings);
+	free(c->lengths);
 	c->strings = NULL;
+	c->lengths = NULL;
 	c->capacity = c->size = 0;
 
+	if (c->map)
+		munmap(c->map, c->map_size);
+	c->map = NULL;
+	c->map_size = 0;
+
+	free(c->prepared);
+	free(c->prepared_offsets);
+	free(c->signatures);
+	c->prepared = NULL;
+	c->prepared_offsets = NULL;
+	c->signatures = NULL;
+	c->prepared_size = c->prepared_count = 0;
+
 	free(c->results);
 	c->results = NULL;
-	c->available = c->selection = 0;
+	c->available = c->selection = c->sorted = c->scored = 0;
+
+	free(c->search);
+	c->search = NULL;
+
+	choices_forget_search(c);
+	free(c->rows);
+	free(c->rows_spare);
+	c->rows = c->rows_spare = NULL;
+
+	if (c->pool)
+		pool_destroy(c->pool);
+	c->pool = NULL;
 }
 
 void choices_add(choices_t *c, const char *choice) {
 	/* Previous search is now invalid */
 	choices_reset_search(c);
-
-	if (c->size == c->capacity) {
-		choices_resize(c, c->capacity * 2);
-	}
-	c->strings[c->size++] = choice;
+	choices_append(c, choice, strlen(choice));
 }
 
 size_t choices_available(choices_t *c) {
 	return c->available;
 }
 
+/*
+ * Batches hold up to BATCH_SIZE candidates, and about BATCH_COST bytes of
+ * them. Towards the end of a search they shrink, though not below
+ * BATCH_COST_MIN, so that the workers all run out of work together.
+ */
 #define BATCH_SIZE 512
+#define BATCH_COST (64 << 10)
+#define BATCH_COST_MIN (4 << 10)
+
+/*
+ * Each worker's result lists are kept from one search to the next, growing
+ * as needed from RESULTS_CHUNK entries.
+ */
+#define RESULTS_CHUNK BATCH_SIZE
 
 struct result_list {
 	struct scored_result *list;
 	size_t size;
+	size_t capacity;
 };
 
 struct search_job {
 	pthread_mutex_t lock;
+
+	/* Signalled once every worker has sorted its results */
+	pthread_cond_t sorted;
+	unsigned int sorting;
+
 	choices_t *choices;
-	const char *search;
-	size_t processed;
+	const query_t *query;
+
+	/* The candidates to search, or all of them without a list */
+	const size_t *candidates;
+	size_t count;
+
+	/* Batch b is candidates [batches[b], batches[b + 1]), out of cost */
+	size_t *batches;
+	size_t batch_count;
+	size_t cost;
+
+	/*
+	 * Each batch lists the candidates which matched at its own position in
+	 * matched, with how many there were in batch_matched (or SIZE_MAX
+	 * until it's done).
+	 */
+	size_t *matched;
+	size_t *batch_matched;
+
+	/*
+	 * The first rows_count candidates may have rows at candidate_rows[k]
+	 * in rows_in to extend. Batches claim room for the rows they keep in
+	 * rows_out, recording where in matched_rows.
+	 */
+	const size_t *candidate_rows;
+	size_t rows_count;
+	const score_t *rows_in;
+	score_t *rows_out;
+	size_t *matched_rows;
 	struct worker *workers;
+
+	/*
+	 * The workers' results are merged into results[0..merge_size), and
+	 * followed by every worker's rest and then everything left unscored.
+	 * Each worker has 2 * worker_count + 2 * merge_leaves of merge_space
+	 * to merge its share in.
+	 */
+	struct scored_result *results;
+	size_t merge_size;
+	size_t scored;
+	size_t available;
+	size_t merge_leaves;
+	size_t *merge_space;
+
+	/*
+	 * Worker 0 asks interrupted between its batches whether to stop, and
+	 * sets cancelled for the others to stop too.
+	 */
+	int (*interrupted)(void *data);
+	void *interrupted_data;
+	int cancelled;
+
+	/*
+	 * Worker 0 also calls progress every so often, with the best results
+	 * so far in provisional: its own heap, and the others' snapshots. It
+	 * then bumps snapshots_wanted, and the others each copy their heap
+	 * (under lock) after their next batch, ready for the next time.
+	 */
+	void (*progress)(void *data);
+	double next_progress;
+	struct result_list provisional;
+
+	/*
+	 * Searching the same query again (as more input arrives) keeps the
+	 * candidate selected at index selected, which was on row selection.
+	 * Without one to keep, selected is SIZE_MAX.
+	 */
+	size_t selected;
+	size_t selection;
+
+	/* Claimed by the workers with atomic adds */
+	size_t next_batch CACHE_ALIGNED;
+	size_t rows_used CACHE_ALIGNED;
+
+	/* How many candidates the workers have been through, and matched */
+	size_t searched CACHE_ALIGNED;
+	size_t found;
+
+	unsigned long snapshots_wanted CACHE_ALIGNED;
 };
 
 struct worker {
-	pthread_t thread_id;
 	struct search_job *job;
 	unsigned int worker_num;
+
+	/* Best results, a heap while searching and then sorted */
 	struct result_list result;
-};
 
-static void worker_get_next_batch(struct search_job *job, size_t *start, size_t *end) {
-	pthread_mutex_lock(&job->lock);
+	/* Results which didn't make the limit, in no particular order */
+	struct result_list rest;
+
+	/* Matches which couldn't make the limit, left unscored */
+	struct result_list pruned;
+
+	/* Room for sorting result */
+	struct result_list spare;
+
+	/* The heap as it was when progress last wanted it */
+	struct result_list snapshot;
+	unsigned long snapshot_taken;
+
+	/* Where rest and pruned go in the search's results */
+	size_t rest_at;
+	size_t pruned_at;
+
+	/* For extending rows which there's no room to keep */
+	score_t rows[MATCH_ROWS_SIZE(MATCH_MAX_LEN)];
+} CACHE_ALIGNED;
+
+/*
+ * The cost of the first k candidates to search: the space they take
+ * prepared, which is in proportion to their length.
+ */
+static size_t search_cost(const choices_t *c, const size_t *cost_prefix, size_t k) {
+	if (cost_prefix)
+		return cost_prefix[k];
+	return k < c->size ? c->prepared_offsets[k] : c->prepared_size;
+}
+
+static void search_batches(struct search_job *job) {
+	const choices_t *c = job->choices;
+	size_t count = job->count;
+
+	/* Without a list of candidates, where they're prepared sums their costs */
+	size_t *cost_prefix = NULL;
+	if (job->candidates) {
+		cost_prefix = malloc((count + 1) * sizeof(size_t));
+		if (!cost_prefix) {
+			fprintf(stderr, "Error: Can't allocate memory\n");
+			abort();
+		}
+		cost_prefix[0] = 0;
+		for (size_t k = 0; k < count; k++) {
+			size_t i = job->candidates[k];
+			cost_prefix[k + 1] = cost_prefix[k] + search_cost(c, NULL, i + 1) - search_cost(c, NULL, i);
+		}
+	}
 
-	*start = job->processed;
+	size_t total = job->cost = search_cost(c, cost_prefix, count);
+	size_t capacity = 16;
+	job->batches = safe_realloc(NULL, capacity * sizeof(size_t));
+	job->batch_count = 0;
+
+	for (size_t start = 0; start < count;) {
+		size_t cost = (total - search_cost(c, cost_prefix, start)) / (2 * c->worker_count);
+		if (cost > BATCH_COST)
+			cost = BATCH_COST;
+		if (cost < BATCH_COST_MIN)
+			cost = BATCH_COST_MIN;
+
+		/* The longest batch within cost, but with at least one candidate */
+		size_t limit = cost + search_cost(c, cost_prefix, start);
+		size_t lo = start + 1, hi = count < start + BATCH_SIZE ? count : start + BATCH_SIZE;
+		while (lo < hi) {
+			size_t mid = lo + (hi - lo + 1) / 2;
+			if (search_cost(c, cost_prefix, mid) <= limit)
+				lo = mid;
+			else
+				hi = mid - 1;
+		}
 
-	job->processed += BATCH_SIZE;
-	if (job->processed > job->choices->size) {
-		job->processed = job->choices->size;
+		if (job->batch_count + 1 == capacity) {
+			capacity *= 2;
+			job->batches = safe_realloc(job->batches, capacity * sizeof(size_t));
+		}
+		job->batches[job->batch_count++] = start;
+		start = lo;
 	}
+	job->batches[job->batch_count] = count;
+
+	free(cost_prefix);
+}
 
-	*end = job->processed;
+static void worker_get_next_batch(struct search_job *job, size_t *batch, size_t *start, size_t *end) {
+	*batch = __atomic_fetch_add(&job->next_batch, 1, __ATOMIC_RELAXED);
+	if (*batch >= job->batch_count || __atomic_load_n(&job->cancelled, __ATOMIC_RELAXED)) {
+		*start = *end = job->count;
+		return;
+	}
 
-	pthread_mutex_unlock(&job->lock);
+	*start = job->batches[*batch];
+	*end = job->batches[*batch + 1];
 }
 
-static struct result_list merge2(struct result_list list1, struct result_list list2) {
-	size_t result_index = 0, index1 = 0, index2 = 0;
+/*
+ * Claim room for size score_t in rows_out, if there's any left. Failed
+ * claims leave rows_used past the end, which only fails any later ones.
+ */
+static size_t worker_claim_rows(struct search_job *job, size_t size) {
+	const size_t capacity = CHOICES_ROWS_BYTES / sizeof(score_t);
 
-	struct result_list result;
-	result.size = list1.size + list2.size;
-	result.list = malloc(result.size * sizeof(struct scored_result));
-	if (!result.list) {
+	size_t at = __atomic_fetch_add(&job->rows_used, size, __ATOMIC_RELAXED);
+	if (at > capacity || size > capacity - at)
+		return CHOICES_NO_ROWS;
+
+	return at;
+}
+
+/* Make room for extra more results in list */
+static void result_list_reserve(struct result_list *list, size_t extra) {
+	if (list->size + extra <= list->capacity)
+		return;
+
+	size_t capacity = list->capacity ? list->capacity : RESULTS_CHUNK;
+	while (capacity < list->size + extra)
+		capacity *= 2;
+
+	list->list = safe_realloc(list->list, capacity * sizeof(struct scored_result));
+	list->capacity = capacity;
+}
+
+static void result_list_free(struct result_list *list) {
+	free(list->list);
+	list->list = NULL;
+	list->size = list->capacity = 0;
+}
+
+static void workers_free(struct worker *workers, unsigned int count) {
+	for (unsigned int i = 0; i < count; i++) {
+		result_list_free(&workers[i].result);
+		result_list_free(&workers[i].rest);
+		result_list_free(&workers[i].pruned);
+		result_list_free(&workers[i].spare);
+		result_list_free(&workers[i].snapshot);
+	}
+}
+
+/* How many of the workers' results come before x, which is list i's t-th */
+static size_t merge_rank(const struct search_job *job, unsigned int i, size_t t) {
+	const struct scored_result *x = &job->workers[i].result.list[t];
+	size_t rank = t;
+
+	for (unsigned int j = 0; j < job->choices->worker_count; j++) {
+		if (j == i)
+			continue;
+
+		const struct result_list *list = &job->workers[j].result;
+		size_t lo = 0, hi = list->size;
+		while (lo < hi) {
+			size_t mid = lo + (hi - lo) / 2;
+			if (cmpchoice(&list->list[mid], x) < 0)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		rank += lo;
+	}
+
+	return rank;
+}
+
+/*
+ * Where the merge reaches position p: the first split[i] results of each
+ * worker i are the first p merged. The ranks of a list's results rise
+ * along it, so each split is a binary search.
+ */
+static void merge_split(const struct search_job *job, size_t p, size_t *split) {
+	for (unsigned int i = 0; i < job->choices->worker_count; i++) {
+		size_t lo = 0, hi = job->workers[i].result.size;
+		if (p == 0)
+			hi = 0;
+		else if (p == job->merge_size)
+			lo = hi;
+		while (lo < hi) {
+			size_t mid = lo + (hi - lo) / 2;
+			if (merge_rank(job, i, mid) < p)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		split[i] = lo;
+	}
+}
+
+/* Which of lists a and b has the next result between at and end, if either */
+static size_t merge_winner(const struct search_job *job, const size_t *at, const size_t *end,
+			   size_t a, size_t b) {
+	unsigned int count = job->choices->worker_count;
+	if (b >= count || at[b] == end[b])
+		return a;
+	if (a >= count || at[a] == end[a])
+		return b;
+
+	const struct scored_result *list_a = job->workers[a].result.list;
+	const struct scored_result *list_b = job->workers[b].result.list;
+	return cmpchoice(&list_a[at[a]], &list_b[at[b]]) < 0 ? a : b;
+}
+
+/*
+ * Merge the workers' results into results[start..end). Which list has the
+ * next result is decided by a tournament between their first results
+ * left, with the lists at its leaves, so only the winner's path has to be
+ * played again after each one.
+ */
+static void merge_share(const struct search_job *job, size_t start, size_t end, size_t *space) {
+	unsigned int count = job->choices->worker_count;
+	size_t leaves = job->merge_leaves;
+	size_t *at = space;
+	size_t *stop = space + count;
+	size_t *tree = space + 2 * count;
+
+	merge_split(job, start, at);
+	merge_split(job, end, stop);
+
+	for (size_t i = 0; i < leaves; i++)
+		tree[leaves + i] = i;
+	for (size_t n = leaves - 1; n > 0; n--)
+		tree[n] = merge_winner(job, at, stop, tree[2 * n], tree[2 * n + 1]);
+
+	for (size_t k = start; k < end; k++) {
+		size_t i = tree[1];
+		job->results[k] = job->workers[i].result.list[at[i]++];
+
+		for (size_t n = (leaves + i) / 2; n > 0; n /= 2)
+			tree[n] = merge_winner(job, at, stop, tree[2 * n], tree[2 * n + 1]);
+	}
+}
+
+/*
+ * Once the last worker has sorted its results, there's room to be made
+ * for all of them.
+ */
+static void search_layout(struct search_job *job) {
+	const choices_t *c = job->choices;
+	struct worker *workers = job->workers;
+
+	job->merge_size = 0;
+	for (unsigned int i = 0; i < c->worker_count; i++)
+		job->merge_size += workers[i].result.size;
+
+	job->scored = job->merge_size;
+	for (unsigned int i = 0; i < c->worker_count; i++) {
+		workers[i].rest_at = job->scored;
+		job->scored += workers[i].rest.size;
+	}
+
+	job->available = job->scored;
+	for (unsigned int i = 0; i < c->worker_count; i++) {
+		workers[i].pruned_at = job->available;
+		job->available += workers[i].pruned.size;
+	}
+
+	job->results = malloc(job->available * sizeof(struct scored_result));
+	if (!job->results && job->available) {
 		fprintf(stderr, "Error: Can't allocate memory\n");
 		abort();
 	}
+}
+
+/*
+ * The best results are kept in a heap with the worst of them at the root,
+ * ordered by cmpchoice.
+ */
+static void result_heap_sift_up(struct scored_result *heap, size_t i) {
+	while (i) {
+		size_t parent = (i - 1) / 2;
+		if (cmpchoice(&heap[parent], &heap[i]) >= 0)
+			break;
+
+		struct scored_result tmp = heap[parent];
+		heap[parent] = heap[i];
+		heap[i] = tmp;
+		i = parent;
+	}
+}
+
+static void result_heap_sift_down(struct scored_result *heap, size_t size, size_t i) {
+	for (;;) {
+		size_t worst = i;
+		size_t left = 2 * i + 1, right = 2 * i + 2;
+
+		if (left < size && cmpchoice(&heap[left], &heap[worst]) > 0)
+			worst = left;
+		if (right < size && cmpchoice(&heap[right], &heap[worst]) > 0)
+			worst = right;
+		if (worst == i)
+			break;
+
+		struct scored_result tmp = heap[worst];
+		heap[worst] = heap[i];
+		heap[i] = tmp;
+		i = worst;
+	}
+}
+
+static void worker_add_result(struct worker *w, size_t limit, struct scored_result result) {
+	struct result_list *best = &w->result;
+	struct result_list *rest = &w->rest;
+
+	if (!limit) {
+		best->list[best->size++] = result;
+	} else if (best->size < limit) {
+		best->list[best->size] = result;
+		result_heap_sift_up(best->list, best->size++);
+	} else if (cmpchoice(&result, &best->list[0]) < 0) {
+		rest->list[rest->size++] = best->list[0];
+		best->list[0] = result;
+		result_heap_sift_down(best->list, best->size, 0);
+	} else {
+		rest->list[rest->size++] = result;
+	}
+}
+
+/*
+ * Whether to keep a candidate's rows. Short ones are scored faster from
+ * scratch together by match_batch than extended one at a time.
+ */
+static int keeps_rows(size_t len) {
+	return len > MATCH_LANES_MAX_NEEDLE && len <= MATCH_MAX_LEN;
+}
 
-	while(index1 < list1.size && index2 < list2.size) {
-		if (cmpchoice(&list1.list[index1], &list2.list[index2]) < 0) {
-			result.list[result_index++] = list1.list[index1++];
+/*
+ * Score a batch, keeping the rows to extend them by another character if
+ * there's room. Those that can carry on from their rows for the last
+ * search, or keep rows, are scored one at a time, and the rest together.
+ */
+static void worker_score(struct worker *w, const size_t *matches, const char **prepared,
+			 const score_t **last_rows, const size_t *slots, size_t count, score_t *scores) {
+	struct search_job *job = w->job;
+	const choices_t *c = job->choices;
+
+	size_t lens[BATCH_SIZE];
+	size_t size = 0;
+	for (size_t k = 0; k < count; k++) {
+		lens[k] = c->lengths[matches[k]];
+		if (keeps_rows(lens[k]))
+			size += MATCH_ROWS_SIZE(lens[k]);
+	}
+	size_t at = CHOICES_NO_ROWS;
+	if (job->rows_out && size)
+		at = worker_claim_rows(job, size);
+
+	const char *together[BATCH_SIZE];
+	size_t together_index[BATCH_SIZE];
+	score_t together_scores[BATCH_SIZE];
+	size_t together_count = 0;
+
+	for (size_t k = 0; k < count; k++) {
+		if (!keeps_rows(lens[k])) {
+			together[together_count] = prepared[k];
+			together_index[together_count++] = k;
+		} else if (at != CHOICES_NO_ROWS) {
+			scores[k] = match_extend(job->query, prepared[k], last_rows[k], job->rows_out + at);
+			job->matched_rows[slots[k]] = at;
+			at += MATCH_ROWS_SIZE(lens[k]);
+		} else if (last_rows[k]) {
+			scores[k] = match_extend(job->query, prepared[k], last_rows[k], w->rows);
 		} else {
-			result.list[result_index++] = list2.list[index2++];
+			together[together_count] = prepared[k];
+			together_index[together_count++] = k;
 		}
 	}
 
-	while(index1 < list1.size) {
-		result.list[result_index++] = list1.list[index1++];
+	match_batch(job->query, together, together_count, together_scores);
+	for (size_t k = 0; k < together_count; k++)
+		scores[together_index[k]] = together_scores[k];
+}
+
+/* Show how a worker's getting on, after a batch of count with found matches */
+static void worker_publish(struct worker *w, size_t count, size_t found) {
+	struct search_job *job = w->job;
+
+	__atomic_fetch_add(&job->searched, count, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&job->found, found, __ATOMIC_RELAXED);
+
+	/* Worker 0 shows its own heap as it is */
+	unsigned long wanted = __atomic_load_n(&job->snapshots_wanted, __ATOMIC_RELAXED);
+	if (w->worker_num == 0 || w->snapshot_taken == wanted)
+		return;
+	w->snapshot_taken = wanted;
+
+	pthread_mutex_lock(&job->lock);
+	w->snapshot.size = 0;
+	result_list_reserve(&w->snapshot, w->result.size);
+	if (w->result.size)
+		memcpy(w->snapshot.list, w->result.list, w->result.size * sizeof(struct scored_result));
+	w->snapshot.size = w->result.size;
+	pthread_mutex_unlock(&job->lock);
+}
+
+/*
+ * Select candidate index again in new results for the same query, if it's
+ * among those in order, or else whatever's on row selection.
+ */
+static void choices_reselect(choices_t *c, size_t index, size_t selection) {
+	for (size_t i = 0; i < c->sorted; i++) {
+		if (c->results[i].index == index) {
+			c->selection = i;
+			return;
+		}
 	}
-	while(index2 < list2.size) {
-		result.list[result_index++] = list2.list[index2++];
+	c->selection = selection < c->available ? selection : 0;
+}
+
+/*
+ * Put the best results so far in place of the search's for progress to
+ * show, then take them away again.
+ */
+static void search_progress(struct search_job *job) {
+	choices_t *c = job->choices;
+	struct result_list *provisional = &job->provisional;
+
+	provisional->size = 0;
+	pthread_mutex_lock(&job->lock);
+	for (unsigned int i = 0; i < c->worker_count; i++) {
+		const struct result_list *snapshot = i ? &job->workers[i].snapshot : &job->workers[i].result;
+		result_list_reserve(provisional, snapshot->size);
+		if (snapshot->size)
+			memcpy(&provisional->list[provisional->size], snapshot->list,
+			       snapshot->size * sizeof(struct scored_result));
+		provisional->size += snapshot->size;
 	}
+	pthread_mutex_unlock(&job->lock);
+	__atomic_fetch_add(&job->snapshots_wanted, 1, __ATOMIC_RELAXED);
+
+	/* With room past the end to sort them in */
+	result_list_reserve(provisional, provisional->size);
+	results_sort(provisional->list, provisional->size, provisional->list + provisional->size);
+	if (provisional->size > c->limit)
+		provisional->size = c->limit;
+
+	c->results = provisional->list;
+	c->available = c->sorted = c->scored = provisional->size;
+	c->searched = __atomic_load_n(&job->searched, __ATOMIC_RELAXED);
+	c->search_count = job->count;
+	c->search_found = __atomic_load_n(&job->found, __ATOMIC_RELAXED);
+	if (job->selected != SIZE_MAX)
+		choices_reselect(c, job->selected, job->selection);
 
-	free(list1.list);
-	free(list2.list);
+	job->progress(job->interrupted_data);
 
-	return result;
+	c->results = NULL;
+	c->selection = c->available = c->sorted = c->scored = 0;
+	c->searched = c->search_count = c->search_found = 0;
+	job->next_progress = now_ms() + PROGRESS_INTERVAL;
 }
 
-static void *choices_search_worker(void *data) {
-	struct worker *w = (struct worker *)data;
-	struct search_job *job = w->job;
+static void choices_search_worker(void *data, unsigned int worker_num) {
+	struct search_job *job = data;
+	struct worker *w = &job->workers[worker_num];
 	const choices_t *c = job->choices;
 	struct result_list *result = &w->result;
+	uint64_t signature = job->query->signature;
 
-	size_t start, end;
+	size_t batch, start, end;
 
 	for(;;) {
-		worker_get_next_batch(job, &start, &end);
+		if (w->worker_num == 0 && job->interrupted && job->interrupted(job->interrupted_data))
+			__atomic_store_n(&job->cancelled, 1, __ATOMIC_RELAXED);
+		else if (w->worker_num == 0 && job->progress && now_ms() >= job->next_progress)
+			search_progress(job);
+
+		worker_get_next_batch(job, &batch, &start, &end);
 
 		if(start == end) {
 			break;
 		}
 
-		for(size_t i = start; i < end; i++) {
-			if (has_match(job->search, c->strings[i])) {
-				result->list[result->size].str = c->strings[i];
-				result->list[result->size].score = match(job->search, c->strings[i]);
-				result->size++;
+		result_list_reserve(result, end - start);
+		if (c->limit) {
+			result_list_reserve(&w->rest, end - start);
+			result_list_reserve(&w->pruned, end - start);
+		}
+
+		size_t matches[BATCH_SIZE];
+		const char *prepared[BATCH_SIZE];
+		const score_t *last_rows[BATCH_SIZE];
+		size_t slots[BATCH_SIZE];
+		score_t scores[BATCH_SIZE];
+		size_t count = 0;
+
+		/* Once the heap is full, nothing scoring below its root can get in */
+		int full = c->limit && result->size == c->limit;
+		result_score_t worst = full ? result->list[0].score : SCORE_MIN;
+
+		size_t *matched = &job->matched[start];
+		size_t matched_count = 0;
+
+		for(size_t k = start; k < end; k++) {
+			size_t i = job->candidates ? job->candidates[k] : k;
+
+			/* Lacking any of the query's characters rules a candidate out */
+			if ((c->signatures[i] & signature) != signature)
+				continue;
+
+			const char *p = c->prepared + c->prepared_offsets[i];
+			if (!query_has_match(job->query, c->strings[i], c->lengths[i], p))
+				continue;
+
+			job->matched_rows[start + matched_count] = CHOICES_NO_ROWS;
+			matched[matched_count++] = i;
+
+			if (full) {
+				/* Kept with its bound, for choices_sort_rest */
+				struct scored_result r = {match_upper_bound(job->query, p), i};
+				if (r.score < worst) {
+					w->pruned.list[w->pruned.size++] = r;
+					continue;
+				}
 			}
+
+			last_rows[count] = NULL;
+			if (k < job->rows_count && job->candidate_rows[k] != CHOICES_NO_ROWS)
+				last_rows[count] = job->rows_in + job->candidate_rows[k];
+			slots[count] = start + matched_count - 1;
+			matches[count] = i;
+			prepared[count++] = p;
+		}
+		job->batch_matched[batch] = matched_count;
+
+		worker_score(w, matches, prepared, last_rows, slots, count, scores);
+
+		for(size_t i = 0; i < count; i++) {
+			struct scored_result r = {scores[i], matches[i]};
+			worker_add_result(w, c->limit, r);
 		}
+
+		if (job->progress)
+			worker_publish(w, end - start, matched_count);
 	}
 
 	/* Sort the partial result */
-	qsort(result->list, result->size, sizeof(struct scored_result), cmpchoice);
+	result_list_reserve(&w->spare, result->size);
+	results_sort(result->list, result->size, w->spare.list);
 
-	/* Fan-in, merging results */
-	for(unsigned int step = 0;; step++) {
-		if (w->worker_num % (2 << step))
-			break;
+	pthread_mutex_lock(&job->lock);
+	if (--job->sorting == 0) {
+		if (!job->cancelled)
+			search_layout(job);
+		pthread_cond_broadcast(&job->sorted);
+	}
+	while (job->sorting)
+		pthread_cond_wait(&job->sorted, &job->lock);
+	pthread_mutex_unlock(&job->lock);
 
-		unsigned int next_worker = w->worker_num | (1 << step);
-		if (next_worker >= c->worker_count)
-			break;
+	if (job->cancelled)
+		return;
 
-		if ((errno = pthread_join(job->workers[next_worker].thread_id, NULL))) {
-			perror("pthread_join");
-			exit(EXIT_FAILURE);
+	/* Every worker merges its share of the results, and moves the rest */
+	size_t share_start = job->merge_size * w->worker_num / c->worker_count;
+	size_t share_end = job->merge_size * (w->worker_num + 1) / c->worker_count;
+	size_t *space = job->merge_space + w->worker_num * (2 * c->worker_count + 2 * job->merge_leaves);
+	merge_share(job, share_start, share_end, space);
+
+	if (w->rest.size)
+		memcpy(&job->results[w->rest_at], w->rest.list, w->rest.size * sizeof(struct scored_result));
+	if (w->pruned.size)
+		memcpy(&job->results[w->pruned_at], w->pruned.list, w->pruned.size * sizeof(struct scored_result));
+}
+
+/* Whether needle's characters all appear in haystack, in order */
+static int is_subsequence(const char *needle, const char *haystack) {
+	for (; *needle; needle++) {
+		haystack = strchr(haystack, *needle);
+		if (!haystack)
+			return 0;
+		haystack++;
+	}
+	return 1;
+}
+
+static size_t cached_search_bytes(const struct cached_search *s) {
+	return s->available * sizeof(struct scored_result) + s->matched_count * sizeof(size_t);
+}
+
+static void cached_search_free(struct cached_search *s) {
+	free(s->search);
+	free(s->results);
+	free(s->matched);
+	free(s->matched_rows);
+}
+
+/* Move the current search out of c, leaving no search */
+static struct cached_search choices_take_search(choices_t *c) {
+	struct cached_search s = {
+		.search = c->search,
+		.results = c->results,
+		.available = c->available,
+		.sorted = c->sorted,
+		.scored = c->scored,
+		.matched = c->matched,
+		.matched_rows = c->matched_rows,
+		.matched_count = c->matched_count,
+		.matched_size = c->matched_size,
+	};
+
+	c->search = NULL;
+	c->results = NULL;
+	c->selection = c->available = c->sorted = c->scored = 0;
+	c->matched = NULL;
+	c->matched_rows = NULL;
+	c->matched_count = c->matched_size = 0;
+
+	return s;
+}
+
+/* Make s the current search, in place of none */
+static void choices_put_search(choices_t *c, const struct cached_search *s) {
+	c->search = s->search;
+	c->results = s->results;
+	c->available = s->available;
+	c->sorted = s->sorted;
+	c->scored = s->scored;
+	c->matched = s->matched;
+	c->matched_rows = s->matched_rows;
+	c->matched_count = s->matched_count;
+	c->matched_size = s->matched_size;
+}
+
+static void choices_cache_remove(choices_t *c, size_t i) {
+	c->cache_bytes -= cached_search_bytes(&c->cache[i]);
+	c->cache[i] = c->cache[--c->cache_count];
+}
+
+/*
+ * Keep a search which is no longer current. When something has to go to
+ * make room, searches which the current one extends go last, as they're
+ * where deleting characters leads. Otherwise the least recently used goes.
+ */
+static void choices_cache_add(choices_t *c, struct cached_search s) {
+	/* Rows are only kept for the current search */
+	free(s.matched_rows);
+	s.matched_rows = NULL;
+
+	size_t bytes = cached_search_bytes(&s);
+	if (!s.search || s.matched_size != c->size || bytes > CHOICES_CACHE_BYTES) {
+		cached_search_free(&s);
+		return;
+	}
+
+	while (c->cache_count == CHOICES_CACHE_ENTRIES || c->cache_bytes + bytes > CHOICES_CACHE_BYTES) {
+		size_t victim = 0;
+		int victim_prefix = 1;
+		for (size_t i = 0; i < c->cache_count; i++) {
+			const char *search = c->cache[i].search;
+			int prefix = !strncmp(search, c->search, strlen(search));
+			if (prefix < victim_prefix ||
+			    (prefix == victim_prefix && c->cache[i].last_used < c->cache[victim].last_used)) {
+				victim = i;
+				victim_prefix = prefix;
+			}
 		}
 
-		w->result = merge2(w->result, job->workers[next_worker].result);
+		cached_search_free(&c->cache[victim]);
+		choices_cache_remove(c, victim);
 	}
 
-	return NULL;
+	s.last_used = c->cache_clock++;
+	c->cache[c->cache_count++] = s;
+	c->cache_bytes += bytes;
 }
 
-void choices_search(choices_t *c, const char *search) {
-	choices_reset_search(c);
+/* Make the cached search for search current, if there is one */
+static int choices_cache_restore(choices_t *c, const char *search) {
+	for (size_t i = 0; i < c->cache_count; i++) {
+		struct cached_search *s = &c->cache[i];
+		if (strcmp(s->search, search))
+			continue;
+
+		/* Candidates added since it are missing from its results */
+		if (s->matched_size != c->size) {
+			cached_search_free(s);
+			choices_cache_remove(c, i);
+			return 0;
+		}
 
-	struct search_job *job = calloc(1, sizeof(struct search_job));
-	if (!job) {
+		choices_put_search(c, s);
+		choices_cache_remove(c, i);
+		return 1;
+	}
+
+	return 0;
+}
+
+static void choices_forget_partial(choices_t *c) {
+	free(c->partial_search);
+	free(c->partial);
+	c->partial_search = NULL;
+	c->partial = NULL;
+	c->partial_count = c->partial_size = 0;
+}
+
+/*
+ * Keep what an interrupted search got through, in place of what was kept
+ * before: the matches of the batches it finished, and the candidates of
+ * those it didn't.
+ */
+static void choices_keep_partial(choices_t *c, const struct search_job *job) {
+	size_t *partial = malloc(job->count * sizeof(size_t));
+	if (!partial && job->count) {
 		fprintf(stderr, "Error: Can't allocate memory\n");
 		abort();
 	}
-	job->search = search;
-	job->choices = c;
-	if (pthread_mutex_init(&job->lock, NULL) != 0) {
-		fprintf(stderr, "Error: pthread_mutex_init failed\n");
+
+	size_t count = 0;
+	for (size_t batch = 0; batch < job->batch_count; batch++) {
+		size_t start = job->batches[batch];
+		size_t end = job->batches[batch + 1];
+		if (job->batch_matched[batch] != SIZE_MAX) {
+			memcpy(&partial[count], &job->matched[start], job->batch_matched[batch] * sizeof(size_t));
+			count += job->batch_matched[batch];
+		} else {
+			for (size_t k = start; k < end; k++)
+				partial[count++] = job->candidates ? job->candidates[k] : k;
+		}
+	}
+
+	choices_forget_partial(c);
+	c->partial_search = c->search;
+	c->partial = partial;
+	c->partial_count = count;
+	c->partial_size = c->size;
+	c->search = NULL;
+}
+
+/*
+ * Make the results of a search over some candidates, and those of the same
+ * search over ones added after them, the current results.
+ */
+static void choices_merge_results(choices_t *c, const struct cached_search *a, const struct cached_search *b) {
+	size_t available = a->available + b->available;
+	struct scored_result *results = malloc(available * sizeof(struct scored_result));
+	if (!results && available) {
+		fprintf(stderr, "Error: Can't allocate memory\n");
 		abort();
 	}
-	job->workers = calloc(c->worker_count, sizeof(struct worker));
-	if (!job->workers) {
+
+	/*
+	 * Either's sorted results can be merged, until one would go after the
+	 * last of the other's, as the other's unsorted ones might go before it.
+	 */
+	size_t i = 0, j = 0, n = 0;
+	while (i < a->sorted || j < b->sorted) {
+		if (j == b->sorted || (i < a->sorted && cmpchoice(&a->results[i], &b->results[j]) < 0)) {
+			if (b->sorted < b->available &&
+			    (!b->sorted || cmpchoice(&a->results[i], &b->results[b->sorted - 1]) > 0))
+				break;
+			results[n++] = a->results[i++];
+		} else {
+			if (a->sorted < a->available &&
+			    (!a->sorted || cmpchoice(&b->results[j], &a->results[a->sorted - 1]) > 0))
+				break;
+			results[n++] = b->results[j++];
+		}
+	}
+	c->sorted = n;
+
+	/* Either side's results are NULL when it has none, so only copy some */
+	if (a->scored > i)
+		memcpy(&results[n], &a->results[i], (a->scored - i) * sizeof(struct scored_result));
+	n += a->scored - i;
+	if (b->scored > j)
+		memcpy(&results[n], &b->results[j], (b->scored - j) * sizeof(struct scored_result));
+	n += b->scored - j;
+	c->scored = n;
+
+	if (a->available > a->scored)
+		memcpy(&results[n], &a->results[a->scored], (a->available - a->scored) * sizeof(struct scored_result));
+	n += a->available - a->scored;
+	if (b->available > b->scored)
+		memcpy(&results[n], &b->results[b->scored], (b->available - b->scored) * sizeof(struct scored_result));
+
+	c->results = results;
+	c->available = available;
+}
+
+void choices_search(choices_t *c, const char *search) {
+	choices_search_interruptible(c, search, NULL, NULL, NULL);
+}
+
+/*
+ * Search, unless interrupted(data) says to stop first. It's asked every
+ * batch or so, and if it does stop the search the last one stays
+ * current. Returns whether the search was finished.
+ *
+ * If the search takes a while (and there's a limit), progress(data) is
+ * called now and then. The best results so far are current for it, and
+ * searched says how far the search has got.
+ */
+int choices_search_interruptible(choices_t *c, const char *search,
+				 int (*interrupted)(void *data), void (*progress)(void *data), void *data) {
+	choices_prepare(c);
+
+	size_t selection = c->selection;
+	size_t selected = SIZE_MAX;
+	if (c->search && !strcmp(c->search, search) && selection < c->sorted)
+		selected = c->results[selection].index;
+	struct cached_search last = choices_take_search(c);
+
+	if (choices_cache_restore(c, search)) {
+		choices_cache_add(c, last);
+		return 1;
+	}
+
+	/*
+	 * Anything matching search matches every query it contains, so if it
+	 * contains the last search only the candidates which matched that (or
+	 * have been added since) need to be looked at. When they all matched,
+	 * that's every candidate anyway.
+	 */
+	const size_t *from = NULL;
+	size_t from_count = 0, from_size = 0;
+	if (last.matched && last.matched_count < last.matched_size && is_subsequence(last.search, search)) {
+		from = last.matched;
+		from_count = last.matched_count;
+		from_size = last.matched_size;
+	}
+
+	/*
+	 * If search only adds a character to the end of the last one, the
+	 * candidates with rows kept by it can be scored from them.
+	 */
+	size_t last_len = last.search ? strlen(last.search) : 0;
+	int extend = last.matched_rows && strlen(search) == last_len + 1 && !strncmp(last.search, search, last_len);
+
+	/*
+	 * If it's the last search again, with candidates added since, only they
+	 * need to be searched. Their results are then merged with its, unless
+	 * choices_add has dropped those.
+	 */
+	int more = last.matched && last.matched_size < c->size && !strcmp(last.search, search) &&
+		   last.available == last.matched_count;
+	if (more) {
+		from = last.matched;
+		from_count = 0;
+		from_size = last.matched_size;
+	}
+
+	/* An interrupted search may have narrowed things down further */
+	if (c->partial && !extend && !more && is_subsequence(c->partial_search, search) &&
+	    (!from || c->partial_count + from_size < from_count + c->partial_size)) {
+		from = c->partial;
+		from_count = c->partial_count;
+		from_size = c->partial_size;
+	}
+
+	size_t *candidates = NULL;
+	const size_t *narrowed = NULL;
+	size_t count = c->size;
+	if (from) {
+		count = from_count + c->size - from_size;
+		narrowed = from;
+		if (c->size > from_size) {
+			candidates = malloc(count * sizeof(size_t));
+			if (!candidates) {
+				fprintf(stderr, "Error: Can't allocate memory\n");
+				abort();
+			}
+			memcpy(candidates, from, from_count * sizeof(size_t));
+			for (size_t i = from_size; i < c->size; i++)
+				candidates[from_count + i - from_size] = i;
+			narrowed = candidates;
+		}
+	}
+
+	c->search = strdup(search);
+	if (!c->search) {
 		fprintf(stderr, "Error: Can't allocate memory\n");
 		abort();
 	}
 
-	struct worker *workers = job->workers;
-	for (int i = c->worker_count - 1; i >= 0; i--) {
-		workers[i].job = job;
-		workers[i].worker_num = i;
-		workers[i].result.size = 0;
-		workers[i].result.list = malloc(c->size * sizeof(struct scored_result)); /* FIXME: This is overkill */
-		if (!workers[i].result.list) {
+	struct search_job job = {0};
+	query_t query;
+	query_init(&query, c->search);
+	job.query = &query;
+	job.choices = c;
+	job.interrupted = interrupted;
+	job.interrupted_data = data;
+	job.progress = c->limit && !more ? progress : NULL;
+	job.next_progress = now_ms() + PROGRESS_INTERVAL;
+	job.selected = selected;
+	job.selection = selection;
+	job.snapshots_wanted = 1;
+	job.candidates = narrowed;
+	job.count = count;
+	job.matched = malloc(count * sizeof(size_t));
+	search_batches(&job);
+
+	/*
+	 * Keeping rows costs more than it saves unless they can be kept for
+	 * every match, so only do it once the candidates would all fit. Each
+	 * needs no more than two scores for every byte it's prepared in, and
+	 * search_batches has added those up.
+	 */
+	int keep_rows = c->extend_searches && !more && 2 * job.cost <= CHOICES_ROWS_BYTES / sizeof(score_t);
+	if (keep_rows && !c->rows_spare) {
+		c->rows_spare = malloc(CHOICES_ROWS_BYTES);
+		if (!c->rows_spare) {
 			fprintf(stderr, "Error: Can't allocate memory\n");
 			abort();
 		}
+	}
 
-		/* These must be created last-to-first to avoid a race condition when fanning in */
-		if ((errno = pthread_create(&workers[i].thread_id, NULL, &choices_search_worker, &workers[i]))) {
-			perror("pthread_create");
-			exit(EXIT_FAILURE);
+	job.batch_matched = malloc((job.batch_count + 1) * sizeof(size_t));
+	for (size_t batch = 0; job.batch_matched && batch < job.batch_count; batch++)
+		job.batch_matched[batch] = SIZE_MAX;
+	job.candidate_rows = extend ? last.matched_rows : NULL;
+	job.rows_count = extend ? last.matched_count : 0;
+	job.rows_in = c->rows;
+	job.rows_out = keep_rows ? c->rows_spare : NULL;
+	job.rows_used = 0;
+	job.matched_rows = malloc(count * sizeof(size_t));
+	if (((!job.matched || !job.matched_rows) && count) || !job.batch_matched) {
+		fprintf(stderr, "Error: Can't allocate memory\n");
+		abort();
+	}
+	if (pthread_mutex_init(&job.lock, NULL) != 0 || pthread_cond_init(&job.sorted, NULL) != 0) {
+		fprintf(stderr, "Error: pthread_mutex_init failed\n");
+		abort();
+	}
+
+	struct worker_pool *pool = choices_pool(c);
+	if (!pool->workers) {
+		size_t size = pool->worker_count * sizeof(struct worker);
+		if ((errno = posix_memalign((void **)&pool->workers, CACHE_LINE, size))) {
+			fprintf(stderr, "Error: Can't allocate memory\n");
+			abort();
 		}
+		memset(pool->workers, 0, size);
 	}
+	job.workers = pool->workers;
 
-	if (pthread_join(workers[0].thread_id, NULL)) {
-		perror("pthread_join");
-		exit(EXIT_FAILURE);
+	struct worker *workers = job.workers;
+	for (unsigned int i = 0; i < c->worker_count; i++) {
+		workers[i].job = &job;
+		workers[i].worker_num = i;
+		workers[i].result.size = workers[i].rest.size = workers[i].pruned.size = 0;
+		workers[i].snapshot.size = workers[i].snapshot_taken = 0;
+	}
+
+	job.sorting = c->worker_count;
+	job.merge_leaves = 1;
+	while (job.merge_leaves < c->worker_count)
+		job.merge_leaves *= 2;
+	job.merge_space = malloc(c->worker_count * (2 * c->worker_count + 2 * job.merge_leaves) * sizeof(size_t));
+	if (!job.merge_space) {
+		fprintf(stderr, "Error: Can't allocate memory\n");
+		abort();
+	}
+
+	pool_run(pool, &choices_search_worker, &job);
+
+	free(job.merge_space);
+	result_list_free(&job.provisional);
+	if (job.cancelled) {
+		/* What's left to search for more is already known */
+		if (more) {
+			free(c->search);
+			c->search = NULL;
+		} else {
+			choices_keep_partial(c, &job);
+		}
+		choices_put_search(c, &last);
+		c->selection = selection;
+
+		free(job.matched);
+		free(job.matched_rows);
+		free(job.batch_matched);
+		free(job.batches);
+		free(candidates);
+		pthread_cond_destroy(&job.sorted);
+		pthread_mutex_destroy(&job.lock);
+		query_destroy(&query);
+		return 0;
+	}
+
+	struct cached_search found = {
+		.results = job.results,
+		.available = job.available,
+		.sorted = job.merge_size,
+		.scored = job.scored,
+	};
+	if (c->limit && found.sorted > c->limit)
+		found.sorted = c->limit;
+
+	if (more) {
+		choices_merge_results(c, &last, &found);
+		free(found.results);
+	} else {
+		c->results = found.results;
+		c->available = found.available;
+		c->sorted = found.sorted;
+		c->scored = found.scored;
+	}
+	if (selected != SIZE_MAX)
+		choices_reselect(c, selected, selection);
+
+	/* Gather the batches' matches, keeping them in order */
+	size_t matched_count = 0;
+	for (size_t batch = 0; batch < job.batch_count; batch++) {
+		size_t start = job.batches[batch];
+		size_t n = job.batch_matched[batch];
+		memmove(&job.matched[matched_count], &job.matched[start], n * sizeof(size_t));
+		memmove(&job.matched_rows[matched_count], &job.matched_rows[start], n * sizeof(size_t));
+		matched_count += n;
+	}
+	if (more) {
+		c->matched = last.matched;
+		if (matched_count) {
+			c->matched = safe_realloc(c->matched, (last.matched_count + matched_count) * sizeof(size_t));
+			memcpy(&c->matched[last.matched_count], job.matched, matched_count * sizeof(size_t));
+		}
+		c->matched_count = last.matched_count + matched_count;
+		free(job.matched);
+		last.matched = NULL;
+	} else {
+		c->matched = job.matched;
+		c->matched_count = matched_count;
+	}
+	c->matched_size = c->size;
+	free(job.batch_matched);
+	free(job.batches);
+
+	/* The last search's rows have been used, and this one's are now kept */
+	if (keep_rows) {
+		c->matched_rows = job.matched_rows;
+		score_t *rows = c->rows;
+		c->rows = c->rows_spare;
+		c->rows_spare = rows;
+	} else {
+		free(job.matched_rows);
 	}
+	free(candidates);
+	choices_forget_partial(c);
+
+	/* The last search is now part of this one */
+	if (more)
+		cached_search_free(&last);
+	else
+		choices_cache_add(c, last);
+
+	pthread_cond_destroy(&job.sorted);
+	pthread_mutex_destroy(&job.lock);
+	query_destroy(&query);
+	return 1;
+}
+
+/*
+ * Make the next search look at every candidate, rather than narrowing the
+ * last one or reusing any before it.
+ */
+void choices_forget_search(choices_t *c) {
+	free(c->matched);
+	free(c->matched_rows);
+	c->matched = NULL;
+	c->matched_rows = NULL;
+	c->matched_count = c->matched_size = 0;
+
+	for (size_t i = 0; i < c->cache_count; i++)
+		cached_search_free(&c->cache[i]);
+	c->cache_count = c->cache_bytes = 0;
+
+	choices_forget_partial(c);
+}
+
+/*
+ * Put results beyond the limit of the last search in order, as far as n.
+ * Each time, at least as many again as are already in order are put in
+ * order, rounded up to a multiple of the limit.
+ *
+ * The ones which go next are picked out with a heap, from the scored
+ * results and then the unscored ones. An unscored one is only scored if
+ * the upper bound it was left with says it could get in.
+ */
+static void choices_sort_rest(choices_t *c, size_t n) {
+	size_t rest = c->available - c->sorted;
+	size_t page = rest;
+	if (c->limit) {
+		page = n + 1 - c->sorted > c->sorted ? n + 1 - c->sorted : c->sorted;
+		page = (page + c->limit - 1) / c->limit * c->limit;
+		if (page > rest)
+			page = rest;
+	}
+
+	query_t query;
+	query_init(&query, c->search);
+
+	struct scored_result *heap = &c->results[c->sorted];
+	size_t size = 0;
+	if (page == rest) {
+		for (size_t i = c->scored; i < c->available; i++) {
+			size_t index = c->results[i].index;
+			c->results[i].score = *c->search ? match_prepared(&query, c->prepared + c->prepared_offsets[index]) : SCORE_MIN;
+		}
+		c->scored = c->available;
+		size = rest;
+	} else {
+		/* Until the heap is full, everything scored is in it */
+		for (size_t i = c->sorted; i < c->scored; i++) {
+			if (size < page) {
+				result_heap_sift_up(heap, size++);
+			} else if (cmpchoice(&c->results[i], &heap[0]) < 0) {
+				struct scored_result r = c->results[i];
+				c->results[i] = heap[0];
+				heap[0] = r;
+				result_heap_sift_down(heap, size, 0);
+			}
+		}
 
-	c->results = workers[0].result.list;
-	c->available = workers[0].result.size;
+		for (size_t i = c->scored; i < c->available; i++) {
+			struct scored_result r = c->results[i];
+			if (size == page && r.score < heap[0].score)
+				continue;
+
+			/* Scored, it goes after the others which are */
+			r.score = *c->search ? match_prepared(&query, c->prepared + c->prepared_offsets[r.index]) : SCORE_MIN;
+			c->results[i] = c->results[c->scored];
+			c->results[c->scored] = r;
+			if (size < page) {
+				result_heap_sift_up(heap, size++);
+			} else if (cmpchoice(&r, &heap[0]) < 0) {
+				c->results[c->scored] = heap[0];
+				heap[0] = r;
+				result_heap_sift_down(heap, size, 0);
+			}
+			c->scored++;
+		}
+	}
+	query_destroy(&query);
 
-	free(workers);
-	pthread_mutex_destroy(&job->lock);
-	free(job);
+	struct scored_result *spare = NULL;
+	if (size >= RADIX_SORT_MIN) {
+		spare = malloc(size * sizeof(struct scored_result));
+		if (!spare) {
+			fprintf(stderr, "Error: Can't allocate memory\n");
+			abort();
+		}
+	}
+	results_sort(heap, size, spare);
+	free(spare);
+	c->sorted += size;
 }
 
 const char *choices_get(choices_t *c, size_t n) {
 	if (n < c->available) {
-		return c->results[n].str;
+		if (n >= c->sorted)
+			choices_sort_rest(c, n);
+		return c->strings[c->results[n].index];
+	} else {
+		return NULL;
+	}
+}
+
+/* Candidate n as match_prepare left it, for match_positions_prepared */
+const char *choices_getprepared(choices_t *c, size_t n) {
+	if (n < c->available) {
+		if (n >= c->sorted)
+			choices_sort_rest(c, n);
+		return c->prepared + c->prepared_offsets[c->results[n].index];
 	} else {
 		return NULL;
 	}
 }
 
+size_t choices_getlen(choices_t *c, size_t n) {
+	if (n < c->available) {
+		if (n >= c->sorted)
+			choices_sort_rest(c, n);
+		return c->lengths[c->results[n].index];
+	} else {
+		return 0;
+	}
+}
+
+#ifdef SCORE_FIXED_POINT
+static score_t result_score(result_score_t score) {
+	return score;
+}
+#else
+/*
+ * Results only keep FLT_DIG digits of a score, so round it to those rather
+ * than give back the float's error in the digits after them. Scores which
+ * had no more digits than that come back exactly as they were.
+ */
+static score_t result_score(result_score_t score) {
+	char buf[32];
+	snprintf(buf, sizeof(buf), "%.*g", FLT_DIG, score);
+	return strtod(buf, NULL);
+}
+#endif
+
 score_t choices_getscore(choices_t *c, size_t n) {
-	return c->results[n].score;
+	if (n < c->available) {
+		if (n >= c->sorted)
+			choices_sort_rest(c, n);
+		return result_score(c->results[n].score);
+	} else {
+		return SCORE_MIN;
+	}
 }
 
 void choices_prev(choices_t *c) {
@@ -1,6 +1,7 @@
 #ifndef CHOICES_H
 #define CHOICES_H CHOICES_H
 
+#include <stdint.h>
 #include <stdio.h>
 
 #include "match.h"
@@ -10,11 +11,45 @@
 extern "C" {
 #endif
 
+/*
+ * Results keep their scores in 32 bits, which is all that fixed point
+ * scores have anyway.
+ */
+#ifdef SCORE_FIXED_POINT
+typedef score_t result_score_t;
+#else
+typedef float result_score_t;
+#endif
+
+/* A candidate, by its index in strings, and its score */
 struct scored_result {
-	score_t score;
-	const char *str;
+	result_score_t score;
+	uint32_t index;
 };
 
+/* Candidates are counted in 32 bits, for the sake of their results */
+#define CHOICES_MAX UINT32_MAX
+
+/* A finished search, kept so that going back to it needs no other */
+struct cached_search {
+	char *search;
+	struct scored_result *results;
+	size_t available;
+	size_t sorted;
+	size_t scored;
+	size_t *matched;
+	size_t *matched_rows;
+	size_t matched_count;
+	size_t matched_size;
+	unsigned long last_used;
+};
+
+#define CHOICES_CACHE_ENTRIES 16
+#define CHOICES_CACHE_BYTES (64 << 20)
+
+#define CHOICES_ROWS_BYTES (32 << 20)
+#define CHOICES_NO_ROWS SIZE_MAX
+
 typedef struct {
 	char *buffer;
 	size_t buffer_size;
@@ -22,22 +57,121 @@ typedef struct {
 	size_t capacity;
 	size_t size;
 
+	/*
+	 * Candidate i is strings[i], which is lengths[i] bytes. It's only
+	 * NUL-terminated if it wasn't read by choices_map, which leaves it in
+	 * map.
+	 */
 	const char **strings;
+	size_t *lengths;
+	void *map;
+	size_t map_size;
+
 	struct scored_result *results;
 
+	/*
+	 * Candidates prepared for matching (see match_prepare), each at
+	 * prepared_offsets[i] in prepared and with its signature in
+	 * signatures[i]. This is done as they are read, or otherwise before
+	 * the next search.
+	 */
+	char *prepared;
+	size_t prepared_size;
+	size_t *prepared_offsets;
+	uint64_t *signatures;
+	size_t prepared_count;
+
 	size_t available;
 	size_t selection;
 
+	/*
+	 * Searches only put the best `limit` results in order (0 orders all of
+	 * them). results[0..sorted) are in order and results[sorted..scored)
+	 * have been scored. The rest only have an upper bound on their score
+	 * until they're needed. They're scored and put in order a page or so
+	 * at a time, as they are asked for.
+	 */
+	size_t limit;
+	size_t sorted;
+	size_t scored;
+	char *search;
+
+	/*
+	 * While a search is showing its progress, it has been through searched
+	 * of the search_count candidates it has to, and found that many
+	 * matches. Otherwise search_count is 0.
+	 */
+	size_t searched;
+	size_t search_count;
+	size_t search_found;
+
+	/*
+	 * The candidates which matched the last search, in order, out of the
+	 * first matched_size. A search containing the last one only needs to
+	 * look at these and any added since.
+	 */
+	size_t *matched;
+	size_t matched_count;
+	size_t matched_size;
+
+	/*
+	 * What's needed to score a search with a character added to the end of
+	 * the last one (see match_extend). The rows of matched candidate k
+	 * start at rows + matched_rows[k], unless that's CHOICES_NO_ROWS.
+	 * Searches take turns to keep their rows in rows and rows_spare, which
+	 * each have room for CHOICES_ROWS_BYTES. They only keep them when
+	 * extend_searches says the next search might need them.
+	 */
+	int extend_searches;
+	size_t *matched_rows;
+	score_t *rows;
+	score_t *rows_spare;
+
+	/*
+	 * Other recent searches, as many as fit in CHOICES_CACHE_ENTRIES and
+	 * CHOICES_CACHE_BYTES.
+	 */
+	struct cached_search cache[CHOICES_CACHE_ENTRIES];
+	size_t cache_count;
+	size_t cache_bytes;
+	unsigned long cache_clock;
+
+	/*
+	 * The candidates which could match an interrupted search, out of the
+	 * first partial_size, in order.
+	 */
+	char *partial_search;
+	size_t *partial;
+	size_t partial_count;
+	size_t partial_size;
+
+	/*
+	 * Input being read in the background (see choices_stream), which is
+	 * only added by choices_stream_update.
+	 */
+	struct choices_reader *reader;
+
 	unsigned int worker_count;
+	struct worker_pool *pool;
 } choices_t;
 
 void choices_init(choices_t *c, options_t *options);
 void choices_fread(choices_t *c, FILE *file, char input_delimiter);
+int choices_map(choices_t *c, int fd, char input_delimiter);
+void choices_stream(choices_t *c, int fd, char input_delimiter);
+int choices_stream_fd(const choices_t *c);
+int choices_stream_update(choices_t *c);
+void choices_stream_wait(choices_t *c, size_t count, long int timeout);
 void choices_destroy(choices_t *c);
 void choices_add(choices_t *c, const char *choice);
 size_t choices_available(choices_t *c);
 void choices_search(choices_t *c, const char *search);
+int choices_search_interruptible(choices_t *c, const char *search,
+				 int (*interrupted)(void *data), void (*progress)(void *data), void *data);
+void choices_forget_search(choices_t *c);
 const char *choices_get(choices_t *c, size_t n);
+size_t choices_getlen(choices_t *c, size_t n);
+const char *choices_getprepared(choices_t *c, size_t n);
 score_t choices_getscore(choices_t *c, size_t n);
 void choices_prev(choices_t *c);
 void choices_next(choices_t *c);
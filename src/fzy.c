@@ -4,6 +4,7 @@
 #include <ctype.h>
 #include <limits.h>
 #include <unistd.h>
+#include <errno.h>
 
 #include "match.h"
 #include "tty.h"
@@ -13,6 +14,16 @@
 
 #include "../config.h"
 
+/* How long (in ms) to wait for a screenful of input before showing any */
+#define STREAM_WAIT 50
+
+/*
+ * Filtering searches once there's FILTER_BATCH more candidates, or a
+ * FILTER_GROWTH'th more, whichever's more, so merging the results stays cheap.
+ */
+#define FILTER_BATCH 65536
+#define FILTER_GROWTH 4
+
 int main(int argc, char *argv[]) {
 	int ret = 0;
 
@@ -22,35 +33,67 @@ int main(int argc, char *argv[]) {
 	choices_t choices;
 	choices_init(&choices, &options);
 
+	FILE *input = stdin;
+	if (options.input_file) {
+		input = fopen(options.input_file, "r");
+		if (!input) {
+			fprintf(stderr, "Error: Can't open %s: %s\n", options.input_file, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+	}
+
 	if (options.benchmark) {
 		if (!options.filter) {
 			fprintf(stderr, "Must specify -e/--show-matches with --benchmark\n");
 			exit(EXIT_FAILURE);
 		}
-		choices_fread(&choices, stdin, options.input_delimiter);
-		for (int i = 0; i < options.benchmark; i++)
+		if (!choices_map(&choices, fileno(input), options.input_delimiter))
+			choices_fread(&choices, input, options.input_delimiter);
+		for (int i = 0; i < options.benchmark; i++) {
+			/* Time full searches, not ones narrowed by the last */
+			choices_forget_search(&choices);
 			choices_search(&choices, options.filter);
+		}
 	} else if (options.filter) {
-		choices_fread(&choices, stdin, options.input_delimiter);
-		choices_search(&choices, options.filter);
+		if (choices_map(&choices, fileno(input), options.input_delimiter)) {
+			choices_search(&choices, options.filter);
+		} else {
+			/*
+			 * Search what's been read while the rest is read, then
+			 * what's been read meanwhile, and so on. Each of these
+			 * searches adds what it finds to the last one's results.
+			 */
+			choices_stream(&choices, fileno(input), options.input_delimiter);
+			do {
+				choices_stream_wait(&choices, choices.size + choices.size / FILTER_GROWTH + FILTER_BATCH, -1);
+				choices_search(&choices, options.filter);
+			} while (choices_stream_fd(&choices) >= 0);
+		}
 		for (size_t i = 0; i < choices_available(&choices); i++) {
 			if (options.show_scores)
-				printf("%f\t", choices_getscore(&choices, i));
-			printf("%s\n", choices_get(&choices, i));
+				printf("%f\t", SCORE_TO_DOUBLE(choices_getscore(&choices, i)));
+			fwrite(choices_get(&choices, i), 1, choices_getlen(&choices, i), stdout);
+			putchar('\n');
 		}
 	} else {
 		/* interactive */
 
-		if (isatty(STDIN_FILENO))
-			choices_fread(&choices, stdin, options.input_delimiter);
+		if (isatty(fileno(input)))
+			choices_fread(&choices, input, options.input_delimiter);
 
 		tty_t tty;
 		tty_init(&tty, options.tty_filename);
 
-		if (!isatty(STDIN_FILENO))
-			choices_fread(&choices, stdin, options.input_delimiter);
+		/*
+		 * Show what's there while the rest is read, once there's enough
+		 * to know whether it needs all of num_lines.
+		 */
+		if (!isatty(fileno(input)) && !choices_map(&choices, fileno(input), options.input_delimiter)) {
+			choices_stream(&choices, fileno(input), options.input_delimiter);
+			choices_stream_wait(&choices, options.num_lines, STREAM_WAIT);
+		}
 
-		if (options.num_lines > choices.size)
+		if (options.num_lines > choices.size && choices_stream_fd(&choices) < 0)
 			options.num_lines = choices.size;
 
 		int num_lines_adjustment = 1;
@@ -66,6 +109,8 @@ int main(int argc, char *argv[]) {
 	}
 
 	choices_destroy(&choices);
+	if (input != stdin)
+		fclose(input);
 
 	return ret;
 }
@@ -5,22 +5,187 @@
 #include <float.h>
 #include <math.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
 
 #include "match.h"
 #include "bonus.h"
 
 #include "../config.h"
 
-char *strcasechr(const char *s, char c) {
-	const char accept[3] = {c, toupper(c), 0};
-	return strpbrk(s, accept);
+#if defined(__AVX2__)
+#include <immintrin.h>
+
+#define VEC_WIDTH 32
+typedef __m256i vec_t;
+#define vec_load(p) _mm256_load_si256((const __m256i *)(p))
+#define vec_set1(c) _mm256_set1_epi8(c)
+#define vec_eq(a, b) _mm256_cmpeq_epi8((a), (b))
+#define vec_or(a, b) _mm256_or_si256((a), (b))
+#define vec_mask(v) ((uint32_t)_mm256_movemask_epi8(v))
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+
+#define VEC_WIDTH 16
+typedef __m128i vec_t;
+#define vec_load(p) _mm_load_si128((const __m128i *)(p))
+#define vec_set1(c) _mm_set1_epi8(c)
+#define vec_eq(a, b) _mm_cmpeq_epi8((a), (b))
+#define vec_or(a, b) _mm_or_si128((a), (b))
+#define vec_mask(v) ((uint32_t)_mm_movemask_epi8(v))
+#endif
+
+#ifdef VEC_WIDTH
+/*
+ * The loads below read past the end of the string on purpose, which the
+ * sanitizers can't tell from a real overflow (or a race, when the bytes past
+ * it are being written by another thread), so they're told to leave it be.
+ */
+#if defined(__has_attribute)
+#if __has_attribute(no_sanitize)
+#define NO_SANITIZE_OVERREAD __attribute__((no_sanitize("address", "thread")))
+#endif
+#endif
+#ifndef NO_SANITIZE_OVERREAD
+#define NO_SANITIZE_OVERREAD
+#endif
+
+/*
+ * Find the first occurrence of either lower or upper in s, before end or
+ * any NUL, scanning VEC_WIDTH bytes at a time.
+ *
+ * Loads are aligned, so although we may read past end or the terminating NUL
+ * we will never cross into a page which doesn't contain part of the string:
+ * pages are a multiple of VEC_WIDTH in size, so each aligned block lies in
+ * the page of its first byte, which is at most the string's last. The bytes
+ * past the end are masked off, so what they hold never matters.
+ */
+NO_SANITIZE_OVERREAD
+static const char *strcasechr(const char *s, const char *end, char lower, char upper) {
+	uintptr_t misalign = (uintptr_t)s % VEC_WIDTH;
+	const char *block = s - misalign;
+
+	const vec_t vlower = vec_set1(lower);
+	const vec_t vupper = vec_set1(upper);
+	const vec_t vzero = vec_set1(0);
+
+	/* Ignore any bytes in the first block which precede s */
+	uint32_t valid = ~(uint32_t)0 << misalign;
+
+	for (; block < end; block += VEC_WIDTH, valid = ~(uint32_t)0) {
+		/* Or which follow end */
+		if (end - block < VEC_WIDTH)
+			valid &= ((uint32_t)1 << (end - block)) - 1;
+
+		vec_t v = vec_load(block);
+		uint32_t found = vec_mask(vec_or(vec_eq(v, vlower), vec_eq(v, vupper))) & valid;
+		uint32_t nul = vec_mask(vec_eq(v, vzero)) & valid;
+
+		/* Only consider matches up to the first NUL */
+		found &= nul ^ (nul - 1);
+
+		if (found)
+			return block + __builtin_ctz(found);
+		if (nul)
+			return NULL;
+	}
+	return NULL;
+}
+#else
+static const char *strcasechr(const char *s, const char *end, char lower, char upper) {
+	for (; s < end && *s; s++) {
+		if (*s == lower || *s == upper)
+			return s;
+	}
+	return NULL;
 }
+#endif
 
 int has_match(const char *needle, const char *haystack) {
+	const char *end = haystack + strlen(haystack);
 	while (*needle) {
 		char nch = *needle++;
 
-		if (!(haystack = strcasechr(haystack, nch))) {
+		if (!(haystack = strcasechr(haystack, end, nch, toupper(nch)))) {
+			return 0;
+		}
+		haystack++;
+	}
+	return 1;
+}
+
+/*
+ * The signature bit for each lowercased character. Those with 0x40 set
+ * (including the letters) take bits 0-31, and the rest (including the
+ * digits and most punctuation) take bits 32-63, so each letter and digit
+ * has its own. It's a table because variable shifts are slow enough to
+ * show up in match_prepare.
+ */
+#define SIGNATURE_BIT(c) ((uint64_t)1 << (((c) & 31) | ((c) & 64 ? 0 : 32)))
+#define SIGNATURE_BITS_4(c) \
+	SIGNATURE_BIT(c), SIGNATURE_BIT(c + 1), SIGNATURE_BIT(c + 2), SIGNATURE_BIT(c + 3)
+#define SIGNATURE_BITS_16(c) \
+	SIGNATURE_BITS_4(c), SIGNATURE_BITS_4(c + 4), SIGNATURE_BITS_4(c + 8), SIGNATURE_BITS_4(c + 12)
+#define SIGNATURE_BITS_64(c) \
+	SIGNATURE_BITS_16(c), SIGNATURE_BITS_16(c + 16), SIGNATURE_BITS_16(c + 32), SIGNATURE_BITS_16(c + 48)
+
+static const uint64_t signature_bits[256] = {
+	SIGNATURE_BITS_64(0), SIGNATURE_BITS_64(64), SIGNATURE_BITS_64(128), SIGNATURE_BITS_64(192),
+};
+
+void query_init(query_t *query, const char *needle) {
+	int n = strlen(needle);
+
+	query->needle = needle;
+	query->len = n;
+	query->lower = malloc(2 * (n + 1));
+	if (!query->lower) {
+		fprintf(stderr, "Error: Can't allocate memory\n");
+		abort();
+	}
+	query->upper = query->lower + n + 1;
+
+	query->lowercase = 1;
+	query->signature = 0;
+	for (int i = 0; i < n; i++) {
+		query->lower[i] = tolower(needle[i]);
+		query->upper[i] = toupper(needle[i]);
+		if (isupper(needle[i]))
+			query->lowercase = 0;
+		query->signature |= signature_bits[(unsigned char)query->lower[i]];
+	}
+	query->lower[n] = query->upper[n] = '\0';
+
+	/*
+	 * Single character needles are cheap to score one at a time, and
+	 * the lanes only have room for needles up to MATCH_LANES_MAX_NEEDLE.
+	 */
+	if (n >= 2 && n <= MATCH_LANES_MAX_NEEDLE) {
+		query->kernel = MATCH_KERNEL_LANES;
+	} else {
+		query->kernel = MATCH_KERNEL_SCALAR;
+	}
+}
+
+void query_destroy(query_t *query) {
+	free(query->lower);
+	query->lower = query->upper = NULL;
+}
+
+int query_has_match(const query_t *query, const char *haystack, size_t len, const char *prepared) {
+	/*
+	 * Without any uppercase characters in the query, case doesn't matter
+	 * and the lowercased candidate can be searched for each character.
+	 */
+	const char *lower = query->lowercase ? query->lower : query->needle;
+	const char *upper = query->lowercase ? query->lower : query->upper;
+	if (query->lowercase)
+		haystack = prepared;
+
+	const char *end = haystack + len;
+	for (int i = 0; i < query->len; i++) {
+		if (!(haystack = strcasechr(haystack, end, lower[i], upper[i]))) {
 			return 0;
 		}
 		haystack++;
@@ -30,99 +195,246 @@ int has_match(const char *needle, const char *haystack) {
 
 #define max(a, b) (((a) > (b)) ? (a) : (b))
 
-struct match_struct {
-	int needle_len;
-	int haystack_len;
+/*
+ * Each thread gets scratch buffers for scoring long candidates and for
+ * match_positions, which are kept (and grown as needed) between calls.
+ */
+enum { SCRATCH_PREPARED, SCRATCH_ROWS, SCRATCH_BITS, SCRATCH_SLOTS };
 
-	char lower_needle[MATCH_MAX_LEN];
-	char lower_haystack[MATCH_MAX_LEN];
+static pthread_key_t scratch_key;
+static pthread_once_t scratch_once = PTHREAD_ONCE_INIT;
 
-	score_t match_bonus[MATCH_MAX_LEN];
+struct scratch {
+	size_t capacity[SCRATCH_SLOTS];
+	void *data[SCRATCH_SLOTS];
 };
 
-static void precompute_bonus(const char *haystack, score_t *match_bonus) {
-	/* Which positions are beginning of words */
+static void scratch_free(void *ptr) {
+	struct scratch *scratch = ptr;
+	for (int slot = 0; slot < SCRATCH_SLOTS; slot++)
+		free(scratch->data[slot]);
+	free(scratch);
+}
+
+static void scratch_key_create(void) {
+	if ((errno = pthread_key_create(&scratch_key, scratch_free))) {
+		perror("pthread_key_create");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void *match_scratch(int slot, size_t size) {
+	pthread_once(&scratch_once, scratch_key_create);
+
+	struct scratch *scratch = pthread_getspecific(scratch_key);
+	if (!scratch) {
+		scratch = calloc(1, sizeof(struct scratch));
+		if (!scratch) {
+			fprintf(stderr, "Error: Can't allocate memory\n");
+			abort();
+		}
+		pthread_setspecific(scratch_key, scratch);
+	}
+
+	if (scratch->capacity[slot] < size) {
+		free(scratch->data[slot]);
+		scratch->data[slot] = malloc(size);
+		if (!scratch->data[slot]) {
+			fprintf(stderr, "Error: Can't allocate memory (%zu bytes)\n", size);
+			abort();
+		}
+		scratch->capacity[slot] = size;
+	}
+
+	return scratch->data[slot];
+}
+
+uint64_t match_prepare(const char *haystack, size_t len, char *prepared) {
+	uint8_t *capitals = (uint8_t *)prepared + len + 1;
+	memset(capitals, 0, (len + 7) / 8);
+
+	uint64_t signature = 0;
 	char last_ch = '/';
-	for (int i = 0; haystack[i]; i++) {
+	for (size_t i = 0; i < len; i++) {
 		char ch = haystack[i];
-		match_bonus[i] = COMPUTE_BONUS(last_ch, ch);
+		prepared[i] = tolower(ch);
+		signature |= signature_bits[(unsigned char)prepared[i]];
+		if (isupper(ch) && islower(last_ch))
+			capitals[i / 8] |= 1 << (i % 8);
 		last_ch = ch;
 	}
+	prepared[len] = '\0';
+
+	return signature;
 }
 
-static void setup_match_struct(struct match_struct *match, const char *needle, const char *haystack) {
-	match->needle_len = strlen(needle);
-	match->haystack_len = strlen(haystack);
+/*
+ * The bonus for matching character j of a prepared candidate. Other than
+ * for capitals, it is the same for the lowercased characters.
+ */
+static inline score_t prepared_bonus(const char *lower, const uint8_t *capitals, int j) {
+	if (capitals[j / 8] & (1 << (j % 8)))
+		return SCORE_CONSTANT(SCORE_MATCH_CAPITAL);
+	return COMPUTE_BONUS(j ? lower[j - 1] : '/', lower[j]);
+}
+
+struct match_struct {
+	int needle_len;
+	int haystack_len;
 
-	if (match->haystack_len > MATCH_MAX_LEN || match->needle_len > match->haystack_len) {
+	/*
+	 * Only haystack[offset, offset + window_len) is scored. This is the
+	 * whole haystack, except for long candidates.
+	 */
+	int offset;
+	int window_len;
+
+	const char *lower_needle;
+	const char *lower_haystack;
+	const uint8_t *capitals;
+
+	/* Long candidates keep 4 rows for D and M in scratch */
+	score_t *rows;
+
+};
+
+/*
+ * Leaves match->lower_haystack NULL if needle is no shorter than haystack,
+ * or if the candidate can't be scored.
+ */
+static void setup_match_struct(struct match_struct *match, const query_t *query, const char *prepared) {
+	int n = match->needle_len = query->len;
+	int m = match->haystack_len = strlen(prepared);
+
+	match->lower_haystack = NULL;
+
+	if (n >= m) {
+		return;
+	}
+
+	match->lower_needle = query->lower;
+
+	if (m <= MATCH_MAX_LEN) {
+		match->offset = 0;
+		match->window_len = m;
+		match->lower_haystack = prepared;
+		match->capitals = (const uint8_t *)prepared + m + 1;
+		match->rows = NULL;
 		return;
 	}
 
-	for (int i = 0; i < match->needle_len; i++)
-		match->lower_needle[i] = tolower(needle[i]);
+	/*
+	 * A long candidate. A match can't start before the first occurrence
+	 * of the needle's first character or end after the last occurrence of
+	 * its last character. Outside of that window every cell of D is
+	 * SCORE_MIN, and the last row of M only accumulates trailing gaps, so
+	 * only the window needs to be scored.
+	 */
+	const char *start = strchr(prepared, query->lower[0]);
+	const char *end = strrchr(prepared, query->lower[n - 1]);
+	if (!start || !end) {
+		return;
+	}
 
-	for (int i = 0; i < match->haystack_len; i++)
-		match->lower_haystack[i] = tolower(haystack[i]);
+	int w = end - start + 1;
+	if (w < n || w > MATCH_MAX_WINDOW || (size_t)n * w > MATCH_MAX_CELLS) {
+		return;
+	}
 
-	precompute_bonus(haystack, match->match_bonus);
+	match->offset = start - prepared;
+	match->window_len = w;
+	match->lower_haystack = prepared;
+	match->capitals = (const uint8_t *)prepared + m + 1;
+	match->rows = match_scratch(SCRATCH_ROWS, 4 * (size_t)w * sizeof(score_t));
 }
 
 static inline void match_row(const struct match_struct *match, int row, score_t *curr_D, score_t *curr_M, const score_t *last_D, const score_t *last_M) {
 	int n = match->needle_len;
-	int m = match->haystack_len;
+	int w = match->window_len;
+	int offset = match->offset;
 	int i = row;
 
 	const char *lower_needle = match->lower_needle;
-	const char *lower_haystack = match->lower_haystack;
-	const score_t *match_bonus = match->match_bonus;
+	const char *lower_haystack = match->lower_haystack + offset;
 
 	score_t prev_score = SCORE_MIN;
-	score_t gap_score = i == n - 1 ? SCORE_GAP_TRAILING : SCORE_GAP_INNER;
+	score_t gap_score = i == n - 1 ? SCORE_CONSTANT(SCORE_GAP_TRAILING)
+				       : SCORE_CONSTANT(SCORE_GAP_INNER);
 
 	/* These will not be used with this value, but not all compilers see it */
 	score_t prev_M = SCORE_MIN, prev_D = SCORE_MIN;
 
-	for (int j = 0; j < m; j++) {
+	for (int j = 0; j < w; j++) {
 		if (lower_needle[i] == lower_haystack[j]) {
 			score_t score = SCORE_MIN;
 			if (!i) {
-				score = (j * SCORE_GAP_LEADING) + match_bonus[j];
+				score = ((offset + j) * SCORE_CONSTANT(SCORE_GAP_LEADING)) +
+					prepared_bonus(match->lower_haystack, match->capitals, offset + j);
 			} else if (j) { /* i > 0 && j > 0*/
 				score = max(
-						prev_M + match_bonus[j],
+						SCORE_ADD(prev_M, prepared_bonus(match->lower_haystack, match->capitals, offset + j)),
 
 						/* consecutive match, doesn't stack with match_bonus */
-						prev_D + SCORE_MATCH_CONSECUTIVE);
+						SCORE_ADD(prev_D, SCORE_CONSTANT(SCORE_MATCH_CONSECUTIVE)));
 			}
 			prev_D = last_D[j];
 			prev_M = last_M[j];
 			curr_D[j] = score;
-			curr_M[j] = prev_score = max(score, prev_score + gap_score);
+			curr_M[j] = prev_score = max(score, SCORE_ADD(prev_score, gap_score));
 		} else {
 			prev_D = last_D[j];
 			prev_M = last_M[j];
 			curr_D[j] = SCORE_MIN;
-			curr_M[j] = prev_score = prev_score + gap_score;
+			curr_M[j] = prev_score = SCORE_ADD(prev_score, gap_score);
 		}
 	}
 }
 
+/* Extend the last row of M from the end of the window to the end of the haystack */
+static score_t match_trailing(const struct match_struct *match, score_t score) {
+	for (int j = match->offset + match->window_len; j < match->haystack_len; j++)
+		score = SCORE_ADD(score, SCORE_CONSTANT(SCORE_GAP_TRAILING));
+	return score;
+}
+
+/*
+ * Prepare a candidate in buf if it fits, or else in scratch memory.
+ */
+static const char *prepare_haystack(const char *haystack, char *buf) {
+	size_t len = strlen(haystack);
+	char *prepared = buf;
+	if (len > MATCH_MAX_LEN)
+		prepared = match_scratch(SCRATCH_PREPARED, MATCH_PREPARED_SIZE(len));
+
+	match_prepare(haystack, len, prepared);
+	return prepared;
+}
+
 score_t match(const char *needle, const char *haystack) {
 	if (!*needle)
 		return SCORE_MIN;
 
+	query_t query;
+	query_init(&query, needle);
+
+	char buf[MATCH_PREPARED_SIZE(MATCH_MAX_LEN)];
+	score_t score = match_prepared(&query, prepare_haystack(haystack, buf));
+
+	query_destroy(&query);
+	return score;
+}
+
+score_t match_prepared(const query_t *query, const char *prepared) {
+	if (!query->len)
+		return SCORE_MIN;
+
 	struct match_struct match;
-	setup_match_struct(&match, needle, haystack);
+	setup_match_struct(&match, query, prepared);
 
 	int n = match.needle_len;
 	int m = match.haystack_len;
 
-	if (m > MATCH_MAX_LEN || n > m) {
-		/*
-		 * Unreasonably large candidate: return no score
-		 * If it is a valid match it will still be returned, it will
-		 * just be ranked below any reasonably sized candidates
-		 */
+	if (n > m) {
 		return SCORE_MIN;
 	} else if (n == m) {
 		/* Since this method can only be called with a haystack which
@@ -130,95 +442,375 @@ score_t match(const char *needle, const char *haystack) {
 		 * strings themselves must also be equal (ignoring case).
 		 */
 		return SCORE_MAX;
+	} else if (!match.lower_haystack) {
+		/*
+		 * Unreasonably large candidate: return no score
+		 * If it is a valid match it will still be returned, it will
+		 * just be ranked below any reasonably sized candidates
+		 */
+		return SCORE_MIN;
 	}
 
+	int w = match.window_len;
+
 	/*
 	 * D[][] Stores the best score for this position ending with a match.
 	 * M[][] Stores the best possible score at this position.
 	 */
-	score_t D[MATCH_MAX_LEN], M[MATCH_MAX_LEN];
+	score_t D_buf[MATCH_MAX_LEN], M_buf[MATCH_MAX_LEN];
+	score_t *D = match.rows ? match.rows : D_buf;
+	score_t *M = match.rows ? match.rows + w : M_buf;
 
 	for (int i = 0; i < n; i++) {
 		match_row(&match, i, D, M, D, M);
 	}
 
-	return M[m - 1];
+	return match_trailing(&match, M[w - 1]);
 }
 
-score_t match_positions(const char *needle, const char *haystack, size_t *positions) {
-	if (!*needle)
+score_t match_extend(const query_t *query, const char *prepared, const score_t *last_rows, score_t *rows) {
+	if (!query->len)
 		return SCORE_MIN;
 
 	struct match_struct match;
-	setup_match_struct(&match, needle, haystack);
+	setup_match_struct(&match, query, prepared);
 
 	int n = match.needle_len;
 	int m = match.haystack_len;
 
-	if (m > MATCH_MAX_LEN || n > m) {
+	if (n > m) {
+		return SCORE_MIN;
+	} else if (n == m) {
+		/* No longer query can match, so the rows won't be needed */
+		return SCORE_MAX;
+	} else if (m > MATCH_MAX_LEN) {
+		/* Long candidates have no rows to keep */
+		return match_prepared(query, prepared);
+	}
+
+	score_t *D = rows;
+	score_t *M = rows + m;
+
+	if (last_rows) {
+		memcpy(rows, last_rows, MATCH_ROWS_SIZE(m) * sizeof(score_t));
+	} else {
+		for (int i = 0; i < n - 1; i++)
+			match_row(&match, i, D, M, D, M);
+	}
+
+	score_t last_M[MATCH_MAX_LEN];
+	match_row(&match, n - 1, D, last_M, D, M);
+
+	/*
+	 * The last row of M has trailing gaps, but once another character is
+	 * added the gaps in this row will be inner ones.
+	 */
+	score_t prev_score = SCORE_MIN;
+	for (int j = 0; j < m; j++)
+		M[j] = prev_score = max(D[j], SCORE_ADD(prev_score, SCORE_CONSTANT(SCORE_GAP_INNER)));
+
+	return last_M[m - 1];
+}
+
+#ifdef SCORE_FIXED_POINT
+#define SCORE_BOUND_SLACK 0
+#else
+/* Room for the rounding error accumulated by the DP */
+#define SCORE_BOUND_SLACK 1e-9
+#endif
+
+score_t match_upper_bound(const query_t *query, const char *prepared) {
+	int n = query->len;
+	if (!n)
+		return SCORE_MIN;
+
+	int m = strlen(prepared);
+	const uint8_t *capitals = (const uint8_t *)prepared + m + 1;
+
+	/*
+	 * The first character of the needle can earn at most the best bonus
+	 * among the positions it could match.
+	 */
+	char first = query->lower[0];
+	score_t first_bonus = SCORE_MIN;
+	for (int j = 0; j < m; j++) {
+		if (prepared[j] == first)
+			first_bonus = max(first_bonus, prepared_bonus(prepared, capitals, j));
+	}
+
+	if (n > m || first_bonus == SCORE_MIN) {
+		return SCORE_MIN;
+	} else if (n == m) {
+		return SCORE_MAX;
+	}
+
+	/*
+	 * Every following character earns at most the larger of the
+	 * consecutive match score and the best bonus, and every unmatched
+	 * character of the haystack costs at least the cheapest gap.
+	 */
+	score_t best_match = max(SCORE_CONSTANT(SCORE_MATCH_CONSECUTIVE),
+				 max(max(SCORE_CONSTANT(SCORE_MATCH_SLASH), SCORE_CONSTANT(SCORE_MATCH_WORD)),
+				     max(SCORE_CONSTANT(SCORE_MATCH_CAPITAL), SCORE_CONSTANT(SCORE_MATCH_DOT))));
+	score_t cheapest_gap = max(SCORE_CONSTANT(SCORE_GAP_LEADING),
+				   max(SCORE_CONSTANT(SCORE_GAP_TRAILING), SCORE_CONSTANT(SCORE_GAP_INNER)));
+
+	return first_bonus + (n - 1) * best_match + (m - n) * cheapest_gap + SCORE_BOUND_SLACK;
+}
+
+/*
+ * Score MATCH_LANES candidates at once.
+ *
+ * This is the same recurrence as match_row, but evaluated one haystack
+ * column at a time for every lane, which only requires keeping one column
+ * (n cells) of D and M per lane. The innermost loops run across lanes with
+ * no data dependencies or branches between them so the compiler is free to
+ * vectorize them.
+ */
+static void match_lanes(const char *lower_needle, int n, const char *const *prepared,
+			const int *lengths, score_t *const *scores) {
+	score_t D[MATCH_LANES_MAX_NEEDLE][MATCH_LANES];
+	score_t M[MATCH_LANES_MAX_NEEDLE][MATCH_LANES];
+
+	/*
+	 * Haystack characters are kept as score_t so that comparing them
+	 * produces a mask of the same width as the scores being selected.
+	 */
+	score_t lower_ch[MATCH_LANES];
+	score_t match_bonus[MATCH_LANES];
+	char last_ch[MATCH_LANES];
+	const uint8_t *capitals[MATCH_LANES];
+
+	int max_length = 0;
+	for (int lane = 0; lane < MATCH_LANES; lane++) {
+		last_ch[lane] = '/';
+		capitals[lane] = (const uint8_t *)prepared[lane] + lengths[lane] + 1;
+		max_length = max(max_length, lengths[lane]);
+	}
+
+	for (int i = 0; i < n; i++) {
+		for (int lane = 0; lane < MATCH_LANES; lane++) {
+			D[i][lane] = SCORE_MIN;
+			M[i][lane] = SCORE_MIN;
+		}
+	}
+
+	for (int j = 0; j < max_length; j++) {
+		/* Transpose the next haystack character of each lane */
+		for (int lane = 0; lane < MATCH_LANES; lane++) {
+			int in_range = j < lengths[lane];
+			char ch = in_range ? prepared[lane][j] : '\0';
+			int capital = in_range && (capitals[lane][j / 8] & (1 << (j % 8)));
+			lower_ch[lane] = ch;
+			match_bonus[lane] = capital ? SCORE_CONSTANT(SCORE_MATCH_CAPITAL)
+						    : COMPUTE_BONUS(last_ch[lane], ch);
+			last_ch[lane] = ch;
+		}
+
 		/*
-		 * Unreasonably large candidate: return no score
-		 * If it is a valid match it will still be returned, it will
-		 * just be ranked below any reasonably sized candidates
+		 * Rows are visited last to first, so row i - 1 still holds the
+		 * previous column when row i is computed.
 		 */
+		for (int i = n - 1; i > 0; i--) {
+			score_t gap_score = i == n - 1 ? SCORE_CONSTANT(SCORE_GAP_TRAILING)
+				       : SCORE_CONSTANT(SCORE_GAP_INNER);
+			score_t nch = lower_needle[i];
+
+			for (int lane = 0; lane < MATCH_LANES; lane++) {
+				score_t score = max(
+						SCORE_ADD(M[i - 1][lane], match_bonus[lane]),
+
+						/* consecutive match, doesn't stack with match_bonus */
+						SCORE_ADD(D[i - 1][lane], SCORE_CONSTANT(SCORE_MATCH_CONSECUTIVE)));
+				score = nch == lower_ch[lane] ? score : SCORE_MIN;
+
+				D[i][lane] = score;
+				M[i][lane] = max(score, SCORE_ADD(M[i][lane], gap_score));
+			}
+		}
+
+		/* First row */
+		{
+			score_t gap_score = n == 1 ? SCORE_CONSTANT(SCORE_GAP_TRAILING)
+						   : SCORE_CONSTANT(SCORE_GAP_INNER);
+			score_t nch = lower_needle[0];
+			score_t leading = j * SCORE_CONSTANT(SCORE_GAP_LEADING);
+
+			for (int lane = 0; lane < MATCH_LANES; lane++) {
+				score_t score = leading + match_bonus[lane];
+				score = nch == lower_ch[lane] ? score : SCORE_MIN;
+
+				D[0][lane] = score;
+				M[0][lane] = max(score, SCORE_ADD(M[0][lane], gap_score));
+			}
+		}
+
+		for (int lane = 0; lane < MATCH_LANES; lane++) {
+			if (j == lengths[lane] - 1)
+				*scores[lane] = M[n - 1][lane];
+		}
+	}
+}
+
+void match_batch(const query_t *query, const char *const *prepared, size_t count, score_t *scores) {
+	int n = query->len;
+
+	const char *lane_haystacks[MATCH_LANES];
+	int lane_lengths[MATCH_LANES];
+	score_t *lane_scores[MATCH_LANES];
+	int lanes = 0;
+
+	for (size_t k = 0; k < count; k++) {
+		int m = strlen(prepared[k]);
+
+		if (query->kernel == MATCH_KERNEL_SCALAR || m > MATCH_MAX_LEN || m <= n) {
+			/* Leave the special cases to match_prepared() */
+			scores[k] = match_prepared(query, prepared[k]);
+			continue;
+		}
+
+		lane_haystacks[lanes] = prepared[k];
+		lane_lengths[lanes] = m;
+		lane_scores[lanes] = &scores[k];
+
+		if (++lanes == MATCH_LANES) {
+			match_lanes(query->lower, n, lane_haystacks, lane_lengths, lane_scores);
+			lanes = 0;
+		}
+	}
+
+	/* Not enough candidates left to fill the lanes */
+	for (int lane = 0; lane < lanes; lane++)
+		*lane_scores[lane] = match_prepared(query, lane_haystacks[lane]);
+}
+
+score_t match_positions_prepared(const query_t *query, const char *prepared, size_t *positions) {
+	if (!query->len)
+		return SCORE_MIN;
+
+	struct match_struct match;
+	setup_match_struct(&match, query, prepared);
+
+	int n = match.needle_len;
+	int m = match.haystack_len;
+
+	if (n > m) {
 		return SCORE_MIN;
 	} else if (n == m) {
 		/* Since this method can only be called with a haystack which
 		 * matches needle. If the lengths of the strings are equal the
 		 * strings themselves must also be equal (ignoring case).
 		 */
-		if (positions)
-			for (int i = 0; i < n; i++)
-				positions[i] = i;
+		for (int i = 0; i < n; i++)
+			positions[i] = i;
 		return SCORE_MAX;
+	} else if (!match.lower_haystack) {
+		/*
+		 * Unreasonably large candidate: return no score
+		 * If it is a valid match it will still be returned, it will
+		 * just be ranked below any reasonably sized candidates
+		 */
+		return SCORE_MIN;
 	}
 
+	int w = match.window_len;
+
+	/*
+	 * The backtrace only needs three facts about each cell, so rather than
+	 * keeping the whole of D[][] and M[][] these are recorded as bits:
+	 *   matched:     D[i][j] != SCORE_MIN
+	 *   optimal:     a match at this cell is the best score, D[i][j] == M[i][j]
+	 *   consecutive: M[i][j] was reached from a match at [i - 1][j - 1]
+	 */
+	size_t stride = (w + 63) / 64;
+	size_t plane = n * stride;
+	uint64_t *matched = match_scratch(SCRATCH_BITS, 3 * plane * sizeof(uint64_t));
+	uint64_t *optimal = matched + plane;
+	uint64_t *consecutive = optimal + plane;
+	memset(matched, 0, 3 * plane * sizeof(uint64_t));
+
 	/*
 	 * D[][] Stores the best score for this position ending with a match.
 	 * M[][] Stores the best possible score at this position.
+	 * Only the current and previous rows are kept.
 	 */
-	score_t (*D)[MATCH_MAX_LEN], (*M)[MATCH_MAX_LEN];
-	M = malloc(sizeof(score_t) * MATCH_MAX_LEN * n);
-	D = malloc(sizeof(score_t) * MATCH_MAX_LEN * n);
+	score_t D_buf[2][MATCH_MAX_LEN], M_buf[2][MATCH_MAX_LEN];
+	score_t *D[2] = {D_buf[0], D_buf[1]}, *M[2] = {M_buf[0], M_buf[1]};
+	if (match.rows) {
+		for (int k = 0; k < 2; k++) {
+			D[k] = match.rows + k * w;
+			M[k] = match.rows + (k + 2) * w;
+		}
+	}
+
+	for (int i = 0; i < n; i++) {
+		score_t *curr_D = D[i % 2], *curr_M = M[i % 2];
+		const score_t *last_D = i ? D[(i - 1) % 2] : curr_D;
+		const score_t *last_M = i ? M[(i - 1) % 2] : curr_M;
+
+		match_row(&match, i, curr_D, curr_M, last_D, last_M);
+
+		for (int j = 0; j < w; j++) {
+			size_t word = i * stride + j / 64;
+			uint64_t bit = (uint64_t)1 << (j % 64);
 
-	match_row(&match, 0, D[0], M[0], D[0], M[0]);
-	for (int i = 1; i < n; i++) {
-		match_row(&match, i, D[i], M[i], D[i - 1], M[i - 1]);
+			if (curr_D[j] != SCORE_MIN) {
+				matched[word] |= bit;
+				if (curr_D[j] == curr_M[j])
+					optimal[word] |= bit;
+			}
+			if (i && j &&
+			    curr_M[j] == SCORE_ADD(last_D[j - 1], SCORE_CONSTANT(SCORE_MATCH_CONSECUTIVE)))
+				consecutive[word] |= bit;
+		}
 	}
 
 	/* backtrace to find the positions of optimal matching */
-	if (positions) {
-		int match_required = 0;
-		for (int i = n - 1, j = m - 1; i >= 0; i--) {
-			for (; j >= 0; j--) {
-				/*
-				 * There may be multiple paths which result in
-				 * the optimal weight.
-				 *
-				 * For simplicity, we will pick the first one
-				 * we encounter, the latest in the candidate
-				 * string.
+	int match_required = 0;
+	for (int i = n - 1, j = w - 1; i >= 0; i--) {
+		for (; j >= 0; j--) {
+			size_t word = i * stride + j / 64;
+			uint64_t bit = (uint64_t)1 << (j % 64);
+
+			/*
+			 * There may be multiple paths which result in
+			 * the optimal weight.
+			 *
+			 * For simplicity, we will pick the first one
+			 * we encounter, the latest in the candidate
+			 * string.
+			 */
+			if ((matched[word] & bit) &&
+			    (match_required || (optimal[word] & bit))) {
+				/* If this score was determined using
+				 * SCORE_MATCH_CONSECUTIVE, the
+				 * previous character MUST be a match
 				 */
-				if (D[i][j] != SCORE_MIN &&
-				    (match_required || D[i][j] == M[i][j])) {
-					/* If this score was determined using
-					 * SCORE_MATCH_CONSECUTIVE, the
-					 * previous character MUST be a match
-					 */
-					match_required =
-					    i && j &&
-					    M[i][j] == D[i - 1][j - 1] + SCORE_MATCH_CONSECUTIVE;
-					positions[i] = j--;
-					break;
-				}
+				match_required = !!(consecutive[word] & bit);
+				positions[i] = match.offset + j--;
+				break;
 			}
 		}
 	}
 
-	score_t result = M[n - 1][m - 1];
-
-	free(M);
-	free(D);
+	score_t result = match_trailing(&match, M[(n - 1) % 2][w - 1]);
 
 	return result;
 }
+
+score_t match_positions(const char *needle, const char *haystack, size_t *positions) {
+	if (!*needle)
+		return SCORE_MIN;
+
+	if (!positions)
+		return match(needle, haystack);
+
+	query_t query;
+	query_init(&query, needle);
+
+	char buf[MATCH_PREPARED_SIZE(MATCH_MAX_LEN)];
+	score_t score = match_positions_prepared(&query, prepare_haystack(haystack, buf), positions);
+
+	query_destroy(&query);
+	return score;
+}
@@ -2,21 +2,115 @@
 #define MATCH_H MATCH_H
 
 #include <math.h>
+#include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+#ifdef SCORE_FIXED_POINT
+/*
+ * Integer scores, in thousandths of the units used in config.h.
+ *
+ * SCORE_MIN behaves like -INFINITY does for doubles: adding to it (with
+ * SCORE_ADD) leaves it unchanged rather than overflowing.
+ */
+typedef int32_t score_t;
+#define SCORE_MAX INT32_MAX
+#define SCORE_MIN INT32_MIN
+#define SCORE_SCALE 1000
+#define SCORE_CONSTANT(x) ((score_t)((x) * SCORE_SCALE + ((x) < 0 ? -0.5 : 0.5)))
+#define SCORE_ADD(a, b) ((a) == SCORE_MIN ? SCORE_MIN : (a) + (b))
+#define SCORE_TO_DOUBLE(s) \
+	((s) == SCORE_MIN ? -INFINITY : (s) == SCORE_MAX ? INFINITY : (double)(s) / SCORE_SCALE)
+#else
 typedef double score_t;
 #define SCORE_MAX INFINITY
 #define SCORE_MIN -INFINITY
+#define SCORE_CONSTANT(x) (x)
+#define SCORE_ADD(a, b) ((a) + (b))
+#define SCORE_TO_DOUBLE(s) (s)
+#endif
 
+/*
+ * Candidates up to MATCH_MAX_LEN are scored using the stack. Longer ones
+ * are scored in heap memory, provided the part of them which could match
+ * is no longer than MATCH_MAX_WINDOW and it takes no more than
+ * MATCH_MAX_CELLS cells of the DP matrix. Any others get SCORE_MIN.
+ */
 #define MATCH_MAX_LEN 1024
+#define MATCH_MAX_WINDOW (1 << 20)
+#define MATCH_MAX_CELLS (1 << 24)
+
+/* Number of candidates scored together by match_batch */
+#define MATCH_LANES 8
+#define MATCH_LANES_MAX_NEEDLE 64
+
+/*
+ * Everything about a candidate which doesn't depend on the search can be
+ * computed once by match_prepare: the candidate lowercased and terminated
+ * by a NUL, followed by a bit for each character which is a capital after
+ * a lowercase letter (the one bonus which lowercasing loses). This takes
+ * MATCH_PREPARED_SIZE(len) bytes.
+ *
+ * It returns the candidate's signature: a bit for each class of
+ * (case-folded) character in it. A candidate can only match a query if its
+ * signature has every bit of the query's.
+ */
+#define MATCH_PREPARED_SIZE(len) ((len) + 1 + ((len) + 7) / 8)
+uint64_t match_prepare(const char *haystack, size_t len, char *prepared);
+
+/*
+ * A search compiled once, so that the work which only depends on it isn't
+ * repeated for every candidate.
+ */
+typedef struct {
+	const char *needle;
+	int len;
+
+	/* The needle lowercased, and the uppercase of each character */
+	char *lower;
+	char *upper;
+
+	/* No uppercase characters, so it matches prepared candidates */
+	int lowercase;
+
+	/* Bits which any matching candidate's signature has */
+	uint64_t signature;
+
+	/* How match_batch scores candidates */
+	enum { MATCH_KERNEL_SCALAR, MATCH_KERNEL_LANES } kernel;
+} query_t;
+
+void query_init(query_t *query, const char *needle);
+void query_destroy(query_t *query);
 
 int has_match(const char *needle, const char *haystack);
 score_t match_positions(const char *needle, const char *haystack, size_t *positions);
 score_t match(const char *needle, const char *haystack);
 
+/*
+ * These take a compiled query, and candidates prepared by match_prepare (from
+ * haystack, which is len bytes and needn't be NUL-terminated).
+ */
+int query_has_match(const query_t *query, const char *haystack, size_t len, const char *prepared);
+score_t match_prepared(const query_t *query, const char *prepared);
+score_t match_positions_prepared(const query_t *query, const char *prepared, size_t *positions);
+void match_batch(const query_t *query, const char *const *prepared, size_t count, score_t *scores);
+
+/* A cheap bound, no less than match_prepared(query, prepared) */
+score_t match_upper_bound(const query_t *query, const char *prepared);
+
+/*
+ * Scores the same as match_prepared, but leaves in rows what's needed to
+ * score the query with a character added to its end: the last rows of D
+ * and M, MATCH_ROWS_SIZE(len) of them for a candidate up to MATCH_MAX_LEN.
+ * Given last_rows from the query without its last character, only the
+ * last row is computed. Without them, it starts from scratch.
+ */
+#define MATCH_ROWS_SIZE(len) (2 * (size_t)(len))
+score_t match_extend(const query_t *query, const char *prepared, const score_t *last_rows, score_t *rows);
+
 #ifdef __cplusplus
 }
 #endif
@@ -16,6 +16,7 @@ static const char *usage_str =
     " -q, --query=QUERY        Use QUERY as the initial search string\n"
     " -e, --show-matches=QUERY Output the sorted matches of QUERY\n"
     " -t, --tty=TTY            Specify file to use as TTY device (default /dev/tty)\n"
+    "     --input=FILE         Read input from FILE instead of stdin\n"
     " -s, --show-scores        Show the scores of each match\n"
     " -0, --read-null          Read input delimited by ASCII NUL characters\n"
     " -j, --workers NUM        Use NUM workers for searching. (default is # of CPUs)\n"
@@ -31,6 +32,7 @@ static struct option longopts[] = {{"show-matches", required_argument, NULL, 'e'
 				   {"query", required_argument, NULL, 'q'},
 				   {"lines", required_argument, NULL, 'l'},
 				   {"tty", required_argument, NULL, 't'},
+				   {"input", required_argument, NULL, 'f'},
 				   {"prompt", required_argument, NULL, 'p'},
 				   {"show-scores", no_argument, NULL, 's'},
 				   {"read-null", no_argument, NULL, '0'},
@@ -49,6 +51,7 @@ void options_init(options_t *options) {
 	options->show_scores     = 0;
 	options->scrolloff       = 1;
 	options->tty_filename    = DEFAULT_TTY;
+	options->input_file      = NULL;
 	options->num_lines       = DEFAULT_NUM_LINES;
 	options->prompt          = DEFAULT_PROMPT;
 	options->workers         = DEFAULT_WORKERS;
@@ -90,6 +93,9 @@ void options_parse(options_t *options, int argc, char *argv[]) {
 			case 't':
 				options->tty_filename = optarg;
 				break;
+			case 'f':
+				options->input_file = optarg;
+				break;
 			case 'p':
 				options->prompt = optarg;
 				break;
@@ -10,6 +10,7 @@ typedef struct {
 	const char *filter;
 	const char *init_search;
 	const char *tty_filename;
+	const char *input_file;
 	int show_scores;
 	unsigned int num_lines;
 	unsigned int scrolloff;
@@ -97,9 +97,15 @@ char tty_getchar(tty_t *tty) {
 }
 
 int tty_input_ready(tty_t *tty, long int timeout, int return_on_signal) {
+	return tty_wait(tty, -1, timeout, return_on_signal) & TTY_INPUT_READY;
+}
+
+int tty_wait(tty_t *tty, int fd, long int timeout, int return_on_signal) {
 	fd_set readfs;
 	FD_ZERO(&readfs);
 	FD_SET(tty->fdin, &readfs);
+	if (fd >= 0)
+		FD_SET(fd, &readfs);
 
 	struct timespec ts = {timeout / 1000, (timeout % 1000) * 1000000};
 
@@ -109,7 +115,7 @@ int tty_input_ready(tty_t *tty, long int timeout, int return_on_signal) {
 		sigaddset(&mask, SIGWINCH);
 
 	int err = pselect(
-			tty->fdin + 1,
+			(fd > tty->fdin ? fd : tty->fdin) + 1,
 			&readfs,
 			NULL,
 			NULL,
@@ -124,7 +130,12 @@ int tty_input_ready(tty_t *tty, long int timeout, int return_on_signal) {
 			exit(EXIT_FAILURE);
 		}
 	} else {
-		return FD_ISSET(tty->fdin, &readfs);
+		int ready = 0;
+		if (FD_ISSET(tty->fdin, &readfs))
+			ready |= TTY_INPUT_READY;
+		if (fd >= 0 && FD_ISSET(fd, &readfs))
+			ready |= TTY_FD_READY;
+		return ready;
 	}
 }
 
@@ -25,6 +25,14 @@ void tty_getwinsz(tty_t *tty);
 char tty_getchar(tty_t *tty);
 int tty_input_ready(tty_t *tty, long int timeout, int return_on_signal);
 
+/*
+ * Waits like tty_input_ready, but for fd (unless it's -1) as well, returning
+ * which of them are ready to read.
+ */
+#define TTY_INPUT_READY 1
+#define TTY_FD_READY 2
+int tty_wait(tty_t *tty, int fd, long int timeout, int return_on_signal);
+
 void tty_setfg(tty_t *tty, int fg);
 void tty_setinvert(tty_t *tty);
 void tty_setunderline(tty_t *tty);
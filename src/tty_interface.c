@@ -2,11 +2,21 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "match.h"
 #include "tty_interface.h"
 #include "../config.h"
 
+/* How often (in ms) to search again while input is still being read */
+#define LOAD_INTERVAL 100
+
+static double now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
 static int isprint_unicode(char c) {
 	return isprint(c) || c & (1 << 7);
 }
@@ -30,23 +40,36 @@ static void clear(tty_interface_t *state) {
 	tty_flush(tty);
 }
 
-static void draw_match(tty_interface_t *state, const char *choice, int selected) {
+/* The compiled query for search, only compiled again when search changes */
+static const query_t *draw_query(tty_interface_t *state, const char *search) {
+	if (state->query_ready && !strcmp(state->query_search, search))
+		return &state->query;
+
+	if (state->query_ready)
+		query_destroy(&state->query);
+	strcpy(state->query_search, search);
+	query_init(&state->query, state->query_search);
+	state->query_ready = 1;
+	return &state->query;
+}
+
+static void draw_match(tty_interface_t *state, const query_t *query, const char *choice, size_t len,
+		       const char *prepared, int selected) {
 	tty_t *tty = state->tty;
 	options_t *options = state->options;
-	char *search = state->last_search;
 
-	int n = strlen(search);
-	size_t positions[MATCH_MAX_LEN];
-	for (int i = 0; i < n + 1 && i < MATCH_MAX_LEN; i++)
+	int n = query->len;
+	size_t positions[SEARCH_SIZE_MAX + 1];
+	for (int i = 0; i < n + 1; i++)
 		positions[i] = -1;
 
-	score_t score = match_positions(search, choice, &positions[0]);
+	score_t score = match_positions_prepared(query, prepared, &positions[0]);
 
 	if (options->show_scores) {
 		if (score == SCORE_MIN) {
 			tty_printf(tty, "(     ) ");
 		} else {
-			tty_printf(tty, "(%5.2f) ", score);
+			tty_printf(tty, "(%5.2f) ", SCORE_TO_DOUBLE(score));
 		}
 	}
 
@@ -58,7 +81,8 @@ static void draw_match(tty_interface_t *state, const char *choice, int selected)
 #endif
 
 	tty_setnowrap(tty);
-	for (size_t i = 0, p = 0; choice[i] != '\0'; i++) {
+	/* Candidates aren't always NUL-terminated (see choices_map) */
+	for (size_t i = 0, p = 0; i < len; i++) {
 		if (positions[p] == i) {
 			tty_setfg(tty, TTY_COLOR_HIGHLIGHT);
 			p++;
@@ -95,17 +119,31 @@ static void draw(tty_interface_t *state) {
 	tty_printf(tty, "%s%s", options->prompt, state->search);
 	tty_clearline(tty);
 
+	/* A search still under way is showing its best results so far */
+	const char *search = state->last_search;
+	if (choices->search_count)
+		search = state->search;
+
 	if (options->show_info) {
-		tty_printf(tty, "\n[%lu/%lu]", choices->available, choices->size);
+		if (choices->search_count) {
+			tty_printf(tty, "\n[%lu/%lu] %lu%%", choices->search_found, choices->size,
+				   choices->searched * 100 / choices->search_count);
+		} else {
+			tty_printf(tty, "\n[%lu/%lu]", choices->available, choices->size);
+		}
+		if (choices_stream_fd(choices) >= 0)
+			tty_printf(tty, " loading");
 		tty_clearline(tty);
 	}
 
+	const query_t *query = draw_query(state, search);
 	for (size_t i = start; i < start + num_lines; i++) {
 		tty_printf(tty, "\n");
 		tty_clearline(tty);
 		const char *choice = choices_get(choices, i);
 		if (choice) {
-			draw_match(state, choice, i == choices->selection);
+			draw_match(state, query, choice, choices_getlen(choices, i),
+				   choices_getprepared(choices, i), i == choices->selection);
 		}
 	}
 
@@ -122,10 +160,71 @@ static void draw(tty_interface_t *state) {
 static void update_search(tty_interface_t *state) {
 	choices_search(state->choices, state->search);
 	strcpy(state->last_search, state->search);
+	state->stale = 0;
+}
+
+static int search_interrupted(void *data) {
+	tty_interface_t *state = data;
+	return tty_input_ready(state->tty, 0, 0);
+}
+
+static void search_progress(void *data) {
+	draw(data);
+}
+
+/*
+ * Search between keys, giving up as soon as another arrives, as it will
+ * only change the search again. Searches which take a while show how
+ * they're getting on.
+ */
+static void update_search_interruptible(tty_interface_t *state) {
+	if (!state->stale && !strcmp(state->last_search, state->search))
+		return;
+
+	if (choices_search_interruptible(state->choices, state->search, search_interrupted,
+					 search_progress, state)) {
+		strcpy(state->last_search, state->search);
+		state->stale = 0;
+		draw(state);
+	}
+}
+
+/*
+ * Add whatever input has been read since last time, and search again.
+ * While it's coming in quickly, that's only done every LOAD_INTERVAL.
+ */
+static void update_loaded(tty_interface_t *state) {
+	if (!choices_stream_update(state->choices))
+		return;
+
+	state->next_load = now_ms() + LOAD_INTERVAL;
+	state->stale = 1;
+	update_search_interruptible(state);
+}
+
+/*
+ * Wait for a key, adding input as it's read meanwhile. Returns 0 if a signal
+ * (or more input) arrived first.
+ */
+static int wait_for_input(tty_interface_t *state) {
+	int fd = choices_stream_fd(state->choices);
+	long int timeout = -1;
+	if (fd >= 0) {
+		double now = now_ms();
+		if (now < state->next_load) {
+			timeout = (long int)(state->next_load - now) + 1;
+			fd = -1;
+		}
+	}
+
+	int ready = tty_wait(state->tty, fd, timeout, 1);
+	if (ready & TTY_FD_READY)
+		update_loaded(state);
+	return ready & TTY_INPUT_READY;
 }
 
 static void update_state(tty_interface_t *state) {
-	if (strcmp(state->last_search, state->search)) {
+	if (state->stale || strcmp(state->last_search, state->search)) {
 		update_search(state);
 		draw(state);
 	}
@@ -143,7 +242,8 @@ static void action_emit(tty_interface_t *state) {
 	const char *selection = choices_get(state->choices, state->choices->selection);
 	if (selection) {
 		/* output the selected result */
-		printf("%s\n", selection);
+		fwrite(selection, 1, choices_getlen(state->choices, state->choices->selection), stdout);
+		putchar('\n');
 	} else {
 		/* No match, output the query instead */
 		printf("%s\n", state->search);
@@ -239,7 +339,11 @@ static void action_autocomplete(tty_interface_t *state) {
 	update_state(state);
 	const char *current_selection = choices_get(state->choices, state->choices->selection);
 	if (current_selection) {
-		strncpy(state->search, choices_get(state->choices, state->choices->selection), SEARCH_SIZE_MAX);
+		size_t len = choices_getlen(state->choices, state->choices->selection);
+		if (len > SEARCH_SIZE_MAX)
+			len = SEARCH_SIZE_MAX;
+		memcpy(state->search, current_selection, len);
+		state->search[len] = '\0';
 		state->cursor = strlen(state->search);
 	}
 }
@@ -267,6 +371,9 @@ void tty_interface_init(tty_interface_t *state, tty_t *tty, choices_t *choices,
 	state->choices = choices;
 	state->options = options;
 	state->ambiguous_key_pending = 0;
+	state->stale = 0;
+	state->next_load = 0;
+	state->query_ready = 0;
 
 	strcpy(state->input, "");
 	strcpy(state->search, "");
@@ -371,13 +478,13 @@ static void handle_input(tty_interface_t *state, const char *s, int handle_ambig
 	strcpy(input, "");
 }
 
-int tty_interface_run(tty_interface_t *state) {
+static int run(tty_interface_t *state) {
 	draw(state);
 
 	for (;;) {
 		do {
-			while(!tty_input_ready(state->tty, -1, 1)) {
-				/* We received a signal (probably WINCH) */
+			while(!wait_for_input(state)) {
+				/* We received a signal (probably WINCH) or more input */
 				draw(state);
 			}
 
@@ -398,8 +505,19 @@ int tty_interface_run(tty_interface_t *state) {
 				return state->exit;
 		}
 
-		update_state(state);
+		update_search_interruptible(state);
 	}
 
 	return state->exit;
 }
+
+int tty_interface_run(tty_interface_t *state) {
+	int exit = run(state);
+
+	if (state->query_ready) {
+		query_destroy(&state->query);
+		state->query_ready = 0;
+	}
+
+	return exit;
+}
@@ -2,6 +2,7 @@
 #define TTY_INTERFACE_H TTY_INTERFACE_H
 
 #include "choices.h"
+#include "match.h"
 #include "options.h"
 #include "tty.h"
 
@@ -20,9 +21,21 @@ typedef struct {
 	char last_search[SEARCH_SIZE_MAX + 1];
 	size_t cursor;
 
+	/* The search being drawn, compiled once for every candidate shown */
+	char query_search[SEARCH_SIZE_MAX + 1];
+	query_t query;
+	int query_ready;
+
 	int ambiguous_key_pending;
 	char input[32]; /* Pending input buffer */
 
+	/*
+	 * Whether candidates have been added since the last search, and when
+	 * (in ms) it's next worth adding any more.
+	 */
+	int stale;
+	double next_load;
+
 	int exit;
 } tty_interface_t;
 
@@ -1,6 +1,7 @@
 #define _GNU_SOURCE
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "../config.h"
 #include "options.h"
@@ -13,16 +14,52 @@
 static options_t default_options;
 static choices_t choices;
 
+/* The same candidates as choices, searched from scratch every time */
+static choices_t full;
+
+/* Candidates added by add_numbered */
+#define NUMBERED_MAX 100000
+static char *numbered[NUMBERED_MAX];
+
 static void setup(void *udata) {
     (void)udata;
 
     options_init(&default_options);
     choices_init(&choices, &default_options);
+    choices_init(&full, &default_options);
 }
 
 static void teardown(void *udata) {
     (void)udata;
     choices_destroy(&choices);
+    choices_destroy(&full);
+    for (int i = 0; i < NUMBERED_MAX; i++) {
+        free(numbered[i]);
+        numbered[i] = NULL;
+    }
+}
+
+/* Add candidates "i % 97/i", for i from start to end, to choices and full */
+static void add_numbered(int start, int end) {
+	for (int i = start; i < end; i++) {
+		asprintf(&numbered[i], "%i/%i", i % 97, i);
+		choices_add(&choices, numbered[i]);
+		choices_add(&full, numbered[i]);
+	}
+}
+
+/* Check that choices has the results full has searching from scratch */
+static enum greatest_test_res check_same_as_full(const char *search) {
+	choices_forget_search(&full);
+	choices_search(&full, search);
+
+	ASSERT_SIZE_T_EQ(full.available, choices.available);
+	for (size_t i = 0; i < full.available; i++) {
+		ASSERT_STR_EQ(choices_get(&full, i), choices_get(&choices, i));
+		ASSERT_EQ(choices_getscore(&full, i), choices_getscore(&choices, i));
+	}
+
+	PASS();
 }
 
 TEST test_choices_empty() {
@@ -58,6 +95,8 @@ TEST test_choices_1() {
 
 	ASSERT(!strcmp(choices_get(&choices, 0), "tags"));
 	ASSERT_EQ(NULL, choices_get(&choices, 1));
+	ASSERT_SIZE_T_EQ(0, choices_getlen(&choices, 1));
+	ASSERT_EQ(SCORE_MIN, choices_getscore(&choices, 1));
 
 	PASS();
 }
@@ -150,6 +189,99 @@ TEST test_choices_large_input() {
 
 	ASSERT_STR_EQ("12", choices_get(&choices, 0));
 
+	/* Best first, with ties in the order they were added */
+	for(size_t i = 1; i < choices.available; i++) {
+		score_t a = choices_getscore(&choices, i - 1);
+		score_t b = choices_getscore(&choices, i);
+		ASSERT(a >= b);
+		if (a == b)
+			ASSERT(atoi(choices_get(&choices, i - 1)) < atoi(choices_get(&choices, i)));
+	}
+
+	for(int i = 0; i < N; i++) {
+		free(strings[i]);
+	}
+
+	PASS();
+}
+
+TEST test_choices_limit() {
+	full.limit = 0;
+
+	/* Enough candidates for these to be prepared by several threads */
+	full.worker_count = 4;
+
+	/* Which shouldn't change the results, however they're merged */
+	choices.worker_count = 3;
+
+	ASSERT(choices.limit > 0);
+	add_numbered(0, 10000);
+
+	/* The workers' results are kept between searches, of any size */
+	const char *searches[] = {"12", "9", "1", "123"};
+	for(size_t s = 0; s < sizeof(searches) / sizeof(searches[0]); s++) {
+		choices_search(&choices, searches[s]);
+		ASSERT(choices.available > choices.limit);
+		ASSERT_SIZE_T_EQ(choices.limit, choices.sorted);
+
+		/* Results past the limit are sorted on demand, a page or so at a time */
+		choices_get(&choices, choices.limit);
+		size_t page = 2 * choices.limit < choices.available ? 2 * choices.limit : choices.available;
+		ASSERT_SIZE_T_EQ(page, choices.sorted);
+		CHECK_CALL(check_same_as_full(searches[s]));
+		ASSERT_SIZE_T_EQ(choices.available, choices.sorted);
+	}
+
+	PASS();
+}
+
+TEST test_choices_reuse_searches() {
+	const int N = 10000;
+	const char *searches[] = {
+		"1", "12", "1/2", "1/29", "", "9", "9/9", "95", "9/",
+		"9/9", "9", "", "1/29", "1/2", "12", "1", "95",
+	};
+
+	int added = 0;
+	for(size_t s = 0; s < sizeof(searches) / sizeof(searches[0]); s++) {
+		/*
+		 * Candidates added between searches must be searched too. Once
+		 * they're all in, earlier searches can be reused.
+		 */
+		int end = (int)(s + 1) * N / 8;
+		if (end > N)
+			end = N;
+		add_numbered(added, end);
+		added = end;
+
+		choices_search(&choices, searches[s]);
+		CHECK_CALL(check_same_as_full(searches[s]));
+	}
+
+	PASS();
+}
+
+TEST test_choices_cache_eviction() {
+	const int N = 1000;
+	char *strings[1000];
+	char search[16];
+
+	for(int i = 0; i < N; i++) {
+		asprintf(&strings[i], "%i", i * 7);
+		choices_add(&choices, strings[i]);
+		choices_add(&full, strings[i]);
+	}
+
+	/* More searches than can be kept, then back again */
+	for(int s = 0; s < 4 * CHOICES_CACHE_ENTRIES; s++) {
+		int n = s < 2 * CHOICES_CACHE_ENTRIES ? s : 4 * CHOICES_CACHE_ENTRIES - s;
+		snprintf(search, sizeof(search), "%i", n);
+
+		choices_search(&choices, search);
+		ASSERT(choices.cache_count <= CHOICES_CACHE_ENTRIES);
+		CHECK_CALL(check_same_as_full(search));
+	}
+
 	for(int i = 0; i < N; i++) {
 		free(strings[i]);
 	}
@@ -157,6 +289,278 @@ TEST test_choices_large_input() {
 	PASS();
 }
 
+/* Interrupts a search once it has been asked *data times */
+static int interrupt_after(void *data) {
+	int *calls = data;
+	return (*calls)-- <= 0;
+}
+
+TEST test_choices_interrupted_search() {
+	const char *searches[] = {"1", "12", "123", "1234", "", "9", "9/", "9/9", "12", "123"};
+
+	choices.worker_count = 4;
+	add_numbered(0, 100000);
+
+	int interrupted = 0;
+	for(size_t s = 0; s < sizeof(searches) / sizeof(searches[0]); s++) {
+		/* An interrupted search leaves the one before it */
+		size_t available = choices.available;
+		int calls = (int)(s % 3);
+		if (!choices_search_interruptible(&choices, searches[s], interrupt_after, NULL, &calls)) {
+			ASSERT_SIZE_T_EQ(available, choices.available);
+			interrupted++;
+			continue;
+		}
+
+		/* Later searches may carry on from where it got to */
+		CHECK_CALL(check_same_as_full(searches[s]));
+	}
+	ASSERT(interrupted > 0);
+
+	PASS();
+}
+
+struct progress_check {
+	choices_t *choices;
+	int calls;
+	int progress;
+	int ordered;
+};
+
+/* Slow to say not to stop at first, so that progress is due */
+static int slow_start(void *data) {
+	struct progress_check *check = data;
+	if (check->calls++ < 2)
+		usleep(2 * 50 * 1000);
+	return 0;
+}
+
+static void check_progress(void *data) {
+	struct progress_check *check = data;
+	choices_t *c = check->choices;
+
+	check->progress++;
+	if (!c->search_count || c->searched > c->search_count || c->available > c->limit)
+		check->ordered = 0;
+	for (size_t i = 1; i < c->available; i++) {
+		if (choices_getscore(c, i - 1) < choices_getscore(c, i))
+			check->ordered = 0;
+	}
+}
+
+TEST test_choices_search_progress() {
+	choices.worker_count = 4;
+	add_numbered(0, 100000);
+
+	struct progress_check check = {&choices, 0, 0, 1};
+	ASSERT(choices_search_interruptible(&choices, "12", slow_start, check_progress, &check));
+	ASSERT(check.progress > 0);
+	ASSERT(check.ordered);
+
+	/* Which leaves the search as it would be anyway */
+	ASSERT_SIZE_T_EQ(0, choices.search_count);
+	CHECK_CALL(check_same_as_full("12"));
+
+	PASS();
+}
+
+TEST test_choices_stream() {
+	int fds[2];
+	ASSERT(pipe(fds) == 0);
+	choices_stream(&choices, fds[0], '\n');
+
+	/* Nothing's added until it's a whole line */
+	ASSERT(write(fds[1], "tw", 2) == 2);
+	choices_stream_wait(&choices, 1, 50);
+	ASSERT_SIZE_T_EQ(0, choices.size);
+	ASSERT(choices_stream_fd(&choices) >= 0);
+
+	ASSERT(write(fds[1], "o\nthree\n\nfo", 11) == 11);
+	choices_stream_wait(&choices, 2, 1000);
+	ASSERT_SIZE_T_EQ(2, choices.size);
+	ASSERT_STR_EQ("two", choices.strings[0]);
+	ASSERT_STR_EQ("three", choices.strings[1]);
+
+	choices_search(&choices, "t");
+	ASSERT_SIZE_T_EQ(2, choices.available);
+
+	/* Enough to go over several chunks, with the last line left open */
+	char line[16];
+	ASSERT(write(fds[1], "ur\n", 3) == 3);
+	for (int i = 0; i < 100000; i++) {
+		int n = snprintf(line, sizeof(line), i < 99999 ? "%i\n" : "%i", i);
+		ASSERT(write(fds[1], line, n) == n);
+	}
+	close(fds[1]);
+	choices_stream_wait(&choices, SIZE_MAX, 5000);
+	ASSERT_EQ(-1, choices_stream_fd(&choices));
+	ASSERT_SIZE_T_EQ(100003, choices.size);
+	ASSERT_STR_EQ("four", choices.strings[2]);
+	for (int i = 0; i < 100000; i++) {
+		snprintf(line, sizeof(line), "%i", i);
+		ASSERT_STR_EQ(line, choices.strings[i + 3]);
+	}
+
+	/* The last search's results are kept until the next one */
+	ASSERT_SIZE_T_EQ(2, choices.available);
+	choices_search(&choices, "t");
+	ASSERT_SIZE_T_EQ(2, choices.available);
+	choices_search(&choices, "99999");
+	ASSERT_SIZE_T_EQ(1, choices.available);
+	ASSERT_STR_EQ("99999", choices_get(&choices, 0));
+
+	close(fds[0]);
+	PASS();
+}
+
+TEST test_choices_stream_search() {
+	const int N = 30000;
+	static char strings[30000][12];
+	const int pieces[] = {1, 10, 500, 4000, 12345, 30000};
+	const char *searches[] = {"1", ""};
+	const size_t limits[] = {10, 0};
+
+	for (int i = 0; i < N; i++)
+		snprintf(strings[i], sizeof(strings[i]), "%i", i);
+
+	for (size_t l = 0; l < sizeof(limits) / sizeof(limits[0]); l++) {
+		for (size_t s = 0; s < sizeof(searches) / sizeof(searches[0]); s++) {
+			choices_t streamed, added;
+			choices_init(&streamed, &default_options);
+			choices_init(&added, &default_options);
+			streamed.limit = added.limit = limits[l];
+			streamed.worker_count = 3;
+
+			int fds[2];
+			ASSERT(pipe(fds) == 0);
+			choices_stream(&streamed, fds[0], '\n');
+
+			/* Searching again only searches what's been added since */
+			int i = 0;
+			for (size_t p = 0; p < sizeof(pieces) / sizeof(pieces[0]); p++) {
+				for (; i < pieces[p]; i++) {
+					size_t len = strlen(strings[i]);
+					ASSERT(write(fds[1], strings[i], len) == (ssize_t)len);
+					ASSERT(write(fds[1], "\n", 1) == 1);
+					choices_add(&added, strings[i]);
+				}
+				choices_stream_wait(&streamed, i, 5000);
+				ASSERT_SIZE_T_EQ(i, streamed.size);
+
+				choices_search(&streamed, searches[s]);
+				choices_search(&added, searches[s]);
+				ASSERT_SIZE_T_EQ(added.available, streamed.available);
+				for (size_t k = 0; k < added.available; k++)
+					ASSERT_STR_EQ(choices_get(&added, k), choices_get(&streamed, k));
+			}
+
+			/* The reader's done with the pipe once it's destroyed */
+			close(fds[1]);
+			choices_destroy(&streamed);
+			choices_destroy(&added);
+			close(fds[0]);
+		}
+	}
+
+	PASS();
+}
+
+TEST test_choices_stream_selection() {
+	int fds[2];
+	ASSERT(pipe(fds) == 0);
+	choices_stream(&choices, fds[0], '\n');
+
+	ASSERT(write(fds[1], "item0\nitem1\nitem2\n", 18) == 18);
+	choices_stream_wait(&choices, 3, 1000);
+	choices_search(&choices, "item");
+	choices_next(&choices);
+	choices_next(&choices);
+	ASSERT_STR_EQ("item2", choices_get(&choices, choices.selection));
+
+	/* Searching again as more arrives keeps the same candidate selected */
+	ASSERT(write(fds[1], "item\nitem3\n", 11) == 11);
+	choices_stream_wait(&choices, 5, 1000);
+	ASSERT_SIZE_T_EQ(5, choices.size);
+	choices_search(&choices, "item");
+	ASSERT_SIZE_T_EQ(5, choices.available);
+	ASSERT_STR_EQ("item", choices_get(&choices, 0));
+	ASSERT_STR_EQ("item2", choices_get(&choices, choices.selection));
+
+	/* But not once the query changes */
+	choices_search(&choices, "item3");
+	ASSERT_SIZE_T_EQ(0, choices.selection);
+
+	close(fds[1]);
+	choices_destroy(&choices);
+	choices_init(&choices, &default_options);
+	close(fds[0]);
+	PASS();
+}
+
+TEST test_choices_map() {
+	/* Only regular files can be mapped */
+	int fds[2];
+	ASSERT(pipe(fds) == 0);
+	ASSERT_EQ(0, choices_map(&choices, fds[0], '\n'));
+	close(fds[0]);
+	close(fds[1]);
+
+	FILE *file = tmpfile();
+	ASSERT(file);
+	fputs("skipped\ntwo\n\nthree\ntags", file);
+	fflush(file);
+
+	/* Reading starts where the file's got to */
+	lseek(fileno(file), 8, SEEK_SET);
+	ASSERT_EQ(1, choices_map(&choices, fileno(file), '\n'));
+	fclose(file);
+
+	/* Candidates are left in place, without NULs */
+	ASSERT_SIZE_T_EQ(3, choices.size);
+	ASSERT_SIZE_T_EQ(3, choices.lengths[0]);
+	ASSERT_EQ(0, strncmp("two\n", choices.strings[0], 4));
+	ASSERT_SIZE_T_EQ(5, choices.lengths[1]);
+	ASSERT_EQ(0, strncmp("three\n", choices.strings[1], 6));
+	ASSERT_SIZE_T_EQ(4, choices.lengths[2]);
+
+	choices_search(&choices, "t");
+	ASSERT_SIZE_T_EQ(3, choices.available);
+	choices_search(&choices, "T");
+	ASSERT_SIZE_T_EQ(0, choices.available);
+	choices_search(&choices, "tw");
+	ASSERT_SIZE_T_EQ(1, choices.available);
+	ASSERT_SIZE_T_EQ(3, choices_getlen(&choices, 0));
+	ASSERT_EQ(choices.strings[0], choices_get(&choices, 0));
+
+	PASS();
+}
+
+TEST test_choices_map_nul() {
+	static const char input[] = "ta\0gs\n\0x\nTag\n";
+	FILE *file = tmpfile();
+	ASSERT(file);
+	fwrite(input, 1, sizeof(input) - 1, file);
+	fflush(file);
+	rewind(file);
+	ASSERT_EQ(1, choices_map(&choices, fileno(file), '\n'));
+	fclose(file);
+
+	/* Lines end at a NUL, as they do when read */
+	ASSERT_SIZE_T_EQ(2, choices.size);
+	ASSERT_SIZE_T_EQ(2, choices.lengths[0]);
+	ASSERT_SIZE_T_EQ(3, choices.lengths[1]);
+
+	choices_search(&choices, "tg");
+	ASSERT_SIZE_T_EQ(1, choices.available);
+	ASSERT_EQ(choices.strings[1], choices_get(&choices, 0));
+
+	choices_search(&choices, "ta");
+	ASSERT_SIZE_T_EQ(2, choices.available);
+	ASSERT_EQ(choices.strings[0], choices_get(&choices, 0));
+
+	PASS();
+}
+
 SUITE(choices_suite) {
 	SET_SETUP(setup, NULL);
 	SET_TEARDOWN(teardown, NULL);
@@ -167,4 +571,14 @@ SUITE(choices_suite) {
 	RUN_TEST(test_choices_without_search);
 	RUN_TEST(test_choices_unicode);
 	RUN_TEST(test_choices_large_input);
+	RUN_TEST(test_choices_limit);
+	RUN_TEST(test_choices_reuse_searches);
+	RUN_TEST(test_choices_cache_eviction);
+	RUN_TEST(test_choices_interrupted_search);
+	RUN_TEST(test_choices_search_progress);
+	RUN_TEST(test_choices_stream);
+	RUN_TEST(test_choices_stream_search);
+	RUN_TEST(test_choices_stream_selection);
+	RUN_TEST(test_choices_map);
+	RUN_TEST(test_choices_map_nul);
 }
@@ -6,7 +6,7 @@
 #include "greatest/greatest.h"
 
 #define SCORE_TOLERANCE 0.000001
-#define ASSERT_SCORE_EQ(a,b) ASSERT_IN_RANGE((a), (b), SCORE_TOLERANCE)
+#define ASSERT_SCORE_EQ(a,b) ASSERT_IN_RANGE(SCORE_CONSTANT(a), (b), SCORE_TOLERANCE)
 #define ASSERT_SIZE_T_EQ(a,b) ASSERT_EQ_FMT((size_t)(a), (b), "%zu")
 
 /* has_match(char *needle, char *haystack) */
@@ -33,6 +33,30 @@ TEST non_match_should_return_false() {
 	PASS();
 }
 
+TEST match_in_long_haystack() {
+	/* Crosses several vector-width blocks before (and after) matching */
+	char haystack[200];
+	memset(haystack, '-', sizeof(haystack) - 1);
+	haystack[sizeof(haystack) - 1] = '\0';
+	haystack[70] = 'A';
+	haystack[131] = 'b';
+
+	ASSERT(has_match("ab", haystack));
+	ASSERT(has_match("Ab", haystack));
+	ASSERT(!has_match("ba", haystack));
+	ASSERT(!has_match("abc", haystack));
+	ASSERT(has_match("ab", haystack + 33));
+	ASSERT(!has_match("ab", haystack + 71));
+	PASS();
+}
+
+TEST uppercase_needle_should_match_case_sensitively() {
+	ASSERT(has_match("a", "A"));
+	ASSERT(has_match("A", "A"));
+	ASSERT(!has_match("A", "a"));
+	PASS();
+}
+
 TEST empty_query_should_always_match() {
 	/* match when query is empty */
 	ASSERT(has_match("", ""));
@@ -80,16 +104,16 @@ TEST should_prefer_start_of_candidate() {
 
 TEST score_exact_match() {
 	/* Exact match is SCORE_MAX */
-	ASSERT_SCORE_EQ(SCORE_MAX, match("abc", "abc"));
-	ASSERT_SCORE_EQ(SCORE_MAX, match("aBc", "abC"));
+	ASSERT_EQ(SCORE_MAX, match("abc", "abc"));
+	ASSERT_EQ(SCORE_MAX, match("aBc", "abC"));
 	PASS();
 }
 
 TEST score_empty_query() {
 	/* Empty query always results in SCORE_MIN */
-	ASSERT_SCORE_EQ(SCORE_MIN, match("", ""));
-	ASSERT_SCORE_EQ(SCORE_MIN, match("", "a"));
-	ASSERT_SCORE_EQ(SCORE_MIN, match("", "bb"));
+	ASSERT_EQ(SCORE_MIN, match("", ""));
+	ASSERT_EQ(SCORE_MIN, match("", "a"));
+	ASSERT_EQ(SCORE_MIN, match("", "bb"));
 	PASS();
 }
 
@@ -136,13 +160,94 @@ TEST score_long_string() {
 	memset(string, 'a', sizeof(string) - 1);
 	string[sizeof(string) - 1] = '\0';
 
-	ASSERT_SCORE_EQ(SCORE_MIN, match("aa", string));
-	ASSERT_SCORE_EQ(SCORE_MIN, match(string, "aa"));
-	ASSERT_SCORE_EQ(SCORE_MIN, match(string, string));
+	ASSERT_SCORE_EQ(SCORE_MATCH_SLASH + SCORE_MATCH_CONSECUTIVE +
+				(sizeof(string) - 3) * SCORE_GAP_TRAILING,
+			match("aa", string));
+	ASSERT_EQ(SCORE_MIN, match(string, "aa"));
+	ASSERT_EQ(SCORE_MAX, match(string, string));
+
+	PASS();
+}
+
+TEST positions_long_string() {
+	/* Only the middle of this is a candidate for matching */
+	char string[3006];
+	memset(string, 'x', 1500);
+	memcpy(string + 1500, "/a/m/o", 6);
+	memset(string + 1506, 'y', 1499);
+	string[sizeof(string) - 1] = '\0';
+
+	size_t positions[3];
+	score_t score = match_positions("amo", string, positions);
+	ASSERT_SIZE_T_EQ(1501, positions[0]);
+	ASSERT_SIZE_T_EQ(1503, positions[1]);
+	ASSERT_SIZE_T_EQ(1505, positions[2]);
+
+	ASSERT_SCORE_EQ(1501 * SCORE_GAP_LEADING + 3 * SCORE_MATCH_SLASH + 2 * SCORE_GAP_INNER +
+				1499 * SCORE_GAP_TRAILING,
+			score);
+	ASSERT_EQ(score, match("amo", string));
+
+	PASS();
+}
+
+/* match_batch and match_upper_bound take a query and prepared candidates */
+static const char *prepare(const char *haystack, char *buf) {
+	match_prepare(haystack, strlen(haystack), buf);
+	return buf;
+}
+
+static score_t prepared_upper_bound(const char *needle, const char *haystack) {
+	char buf[MATCH_PREPARED_SIZE(64)];
+	query_t query;
+	query_init(&query, needle);
+	score_t bound = match_upper_bound(&query, prepare(haystack, buf));
+	query_destroy(&query);
+	return bound;
+}
+
+TEST batch_should_score_each_candidate() {
+	const char *haystacks[] = {
+		"app/models/order", "app/models/zrder", "app/m/foo", "app/models/foo",
+		"amo", "Gemfile", "a/m/o", "**a*m*o**", "AMO/", "xamo", "amamamo",
+	};
+	size_t count = sizeof(haystacks) / sizeof(haystacks[0]);
+	score_t scores[sizeof(haystacks) / sizeof(haystacks[0])];
+	const char *prepared[sizeof(haystacks) / sizeof(haystacks[0])];
+	char buf[sizeof(haystacks) / sizeof(haystacks[0])][MATCH_PREPARED_SIZE(16)];
+
+	ASSERT(count > MATCH_LANES);
+
+	/* Gemfile doesn't match, so don't ask for it to be scored */
+	haystacks[5] = haystacks[0];
+
+	for (size_t i = 0; i < count; i++)
+		prepared[i] = prepare(haystacks[i], buf[i]);
+
+	query_t query;
+	query_init(&query, "amo");
+	match_batch(&query, prepared, count, scores);
+	query_destroy(&query);
+
+	for (size_t i = 0; i < count; i++)
+		ASSERT_EQ(match("amo", haystacks[i]), scores[i]);
 
 	PASS();
 }
 
+TEST upper_bound() {
+	const char *haystacks[] = {"app/models/order", "a", "ab", "/ab", "xaxb", "Gemfile.lock", "b/a/b"};
+	for (size_t i = 0; i < sizeof(haystacks) / sizeof(haystacks[0]); i++)
+		ASSERT(prepared_upper_bound("ab", haystacks[i]) >= match("ab", haystacks[i]));
+
+	/* A single character's bound is exact */
+	ASSERT_SCORE_EQ(SCORE_GAP_TRAILING * 2 + SCORE_MATCH_SLASH, prepared_upper_bound("b", "b/a"));
+
+	/* Longer candidates have lower bounds */
+	ASSERT(prepared_upper_bound("ab", "ab/cdefgh") < prepared_upper_bound("ab", "ab/cd"));
+	PASS();
+}
+
 TEST positions_consecutive() {
 	size_t positions[3];
 	match_positions("amo", "app/models/foo", positions);
@@ -201,12 +306,34 @@ TEST positions_exact_match() {
 	PASS();
 }
 
+TEST positions_long_needle() {
+	/* "ab" repeated, matched by every other "b" */
+	char haystack[MATCH_MAX_LEN + 1], needle[MATCH_MAX_LEN / 4 + 1];
+	for (int i = 0; i < MATCH_MAX_LEN; i++)
+		haystack[i] = i % 2 ? 'b' : 'a';
+	haystack[MATCH_MAX_LEN] = '\0';
+	memset(needle, 'b', sizeof(needle) - 1);
+	needle[sizeof(needle) - 1] = '\0';
+
+	size_t positions[MATCH_MAX_LEN / 4];
+	match_positions(needle, haystack, positions);
+	ASSERT_EQ('b', haystack[positions[0]]);
+	for (size_t i = 1; i < sizeof(positions) / sizeof(positions[0]); i++) {
+		/* No gaps longer than necessary */
+		ASSERT_SIZE_T_EQ(positions[i - 1] + 2, positions[i]);
+	}
+
+	PASS();
+}
+
 SUITE(match_suite) {
 	RUN_TEST(exact_match_should_return_true);
 	RUN_TEST(partial_match_should_return_true);
 	RUN_TEST(empty_query_should_always_match);
 	RUN_TEST(non_match_should_return_false);
 	RUN_TEST(match_with_delimiters_in_between);
+	RUN_TEST(match_in_long_haystack);
+	RUN_TEST(uppercase_needle_should_match_case_sensitively);
 
 	RUN_TEST(should_prefer_starts_of_words);
 	RUN_TEST(should_prefer_consecutive_letters);
@@ -223,10 +350,14 @@ SUITE(match_suite) {
 	RUN_TEST(score_capital);
 	RUN_TEST(score_dot);
 	RUN_TEST(score_long_string);
+	RUN_TEST(batch_should_score_each_candidate);
+	RUN_TEST(upper_bound);
 
 	RUN_TEST(positions_consecutive);
 	RUN_TEST(positions_start_of_word);
 	RUN_TEST(positions_no_bonuses);
+	RUN_TEST(positions_long_string);
 	RUN_TEST(positions_multiple_candidates_start_of_words);
 	RUN_TEST(positions_exact_match);
+	RUN_TEST(positions_long_needle);
 }
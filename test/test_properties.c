@@ -5,6 +5,7 @@
 #include "theft/theft.h"
 
 #include "match.h"
+#include "../config.h"
 
 static void *string_alloc_cb(struct theft *t, theft_hash seed, void *env) {
 	(void)env;
@@ -113,6 +114,65 @@ TEST should_return_results_if_there_is_a_match() {
 	PASS();
 }
 
+/* Straightforward byte-at-a-time version of has_match */
+static int reference_has_match(const char *needle, const char *haystack) {
+	for (; *needle; needle++) {
+		char upper = toupper(*needle);
+		while (*haystack && *haystack != *needle && *haystack != upper)
+			haystack++;
+		if (!*haystack++)
+			return 0;
+	}
+	return 1;
+}
+
+static theft_trial_res prop_has_match_should_equal_reference(char *needle, char *haystack) {
+	int expected = reference_has_match(needle, haystack);
+	if (has_match(needle, haystack) != expected)
+		return THEFT_TRIAL_FAIL;
+
+	/* A compiled query should agree, whichever form of haystack it reads */
+	size_t len = strlen(haystack);
+	char *prepared = malloc(MATCH_PREPARED_SIZE(len));
+	uint64_t signature = match_prepare(haystack, len, prepared);
+	query_t query;
+	query_init(&query, needle);
+	int matched = query_has_match(&query, haystack, len, prepared);
+
+	/* even if it's followed by the needle, rather than a NUL */
+	size_t needle_len = strlen(needle);
+	char *unterminated = malloc(len + needle_len + 1);
+	memcpy(unterminated, haystack, len);
+	memcpy(unterminated + len, needle, needle_len + 1);
+	int matched_unterminated = query_has_match(&query, unterminated, len, prepared);
+	free(unterminated);
+
+	/* and a match can't be ruled out by its signature */
+	int signed_out = (signature & query.signature) != query.signature;
+	query_destroy(&query);
+	free(prepared);
+
+	if (matched != expected || matched_unterminated != expected || (expected && signed_out))
+		return THEFT_TRIAL_FAIL;
+
+	return THEFT_TRIAL_PASS;
+}
+
+TEST has_match_should_equal_reference() {
+	struct theft *t = theft_init(0);
+	struct theft_cfg cfg = {
+	    .name = __func__,
+	    .fun = prop_has_match_should_equal_reference,
+	    .type_info = {&string_info, &string_info},
+	    .trials = 100000,
+	};
+
+	theft_run_res res = theft_run(t, &cfg);
+	theft_free(t);
+	GREATEST_ASSERT_EQm("has_match_should_equal_reference", THEFT_RUN_PASS, res);
+	PASS();
+}
+
 static theft_trial_res prop_positions_should_match_characters_in_string(char *needle,
 									char *haystack) {
 	int match_exists = has_match(needle, haystack);
@@ -159,7 +219,259 @@ TEST positions_should_match_characters_in_string() {
 	PASS();
 }
 
+static theft_trial_res prop_match_batch_should_equal_match(char *needle, char *haystack) {
+	/*
+	 * Build a needle from the second half of haystack, so that it's a
+	 * subsequence of many of haystack's suffixes.
+	 */
+	char subsequence[MATCH_LANES_MAX_NEEDLE + 1];
+	size_t len = strlen(haystack);
+	size_t step = 1 + (unsigned char)needle[0] % 7;
+	size_t n = 0;
+	for (size_t j = len / 2; j < len && n < MATCH_LANES_MAX_NEEDLE; j += step)
+		subsequence[n++] = haystack[j];
+	subsequence[n] = '\0';
+
+	/* Score several suffixes of haystack, enough to fill the lanes */
+	const char *haystacks[2 * MATCH_LANES + 1];
+	const char *prepared[2 * MATCH_LANES + 1];
+	char *buf = malloc((2 * MATCH_LANES + 1) * MATCH_PREPARED_SIZE(len));
+	score_t scores[2 * MATCH_LANES + 1];
+	size_t count = 0;
+	for (size_t k = 0; haystack[k] && count < 2 * MATCH_LANES + 1; k++) {
+		if (has_match(subsequence, haystack + k)) {
+			char *p = buf + count * MATCH_PREPARED_SIZE(len);
+			match_prepare(haystack + k, len - k, p);
+			prepared[count] = p;
+			haystacks[count++] = haystack + k;
+		}
+	}
+	if (!count) {
+		free(buf);
+		return THEFT_TRIAL_SKIP;
+	}
+
+	query_t query;
+	query_init(&query, subsequence);
+	match_batch(&query, prepared, count, scores);
+	query_destroy(&query);
+
+	free(buf);
+
+	for (size_t k = 0; k < count; k++) {
+		if (scores[k] != match(subsequence, haystacks[k]))
+			return THEFT_TRIAL_FAIL;
+	}
+
+	return THEFT_TRIAL_PASS;
+}
+
+TEST match_batch_should_equal_match() {
+	struct theft *t = theft_init(0);
+	struct theft_cfg cfg = {
+	    .name = __func__,
+	    .fun = prop_match_batch_should_equal_match,
+	    .type_info = {&string_info, &string_info},
+	    .trials = 20000,
+	};
+
+	theft_run_res res = theft_run(t, &cfg);
+	theft_free(t);
+	GREATEST_ASSERT_EQm("match_batch_should_equal_match", THEFT_RUN_PASS, res);
+	PASS();
+}
+
+static double reference_bonus(char last_ch, char ch) {
+	int lower = ch >= 'a' && ch <= 'z';
+	int upper = ch >= 'A' && ch <= 'Z';
+	int digit = ch >= '0' && ch <= '9';
+
+	if (!lower && !upper && !digit)
+		return 0;
+	if (last_ch == '/')
+		return SCORE_MATCH_SLASH;
+	if (last_ch == '-' || last_ch == '_' || last_ch == ' ')
+		return SCORE_MATCH_WORD;
+	if (last_ch == '.')
+		return SCORE_MATCH_DOT;
+	if (upper && last_ch >= 'a' && last_ch <= 'z')
+		return SCORE_MATCH_CAPITAL;
+	return 0;
+}
+
+#define max(a, b) (((a) > (b)) ? (a) : (b))
+
+/* Straightforward double precision version of match() */
+static double reference_match(const char *needle, const char *haystack) {
+	int n = strlen(needle);
+	int m = strlen(haystack);
+
+	if (!n || m > MATCH_MAX_LEN || n > m)
+		return -INFINITY;
+	if (n == m)
+		return INFINITY;
+
+	double D[2][MATCH_MAX_LEN], M[2][MATCH_MAX_LEN];
+	for (int i = 0; i < n; i++) {
+		double *curr_D = D[i % 2], *curr_M = M[i % 2];
+		const double *last_D = D[(i + 1) % 2], *last_M = M[(i + 1) % 2];
+		double gap = i == n - 1 ? SCORE_GAP_TRAILING : SCORE_GAP_INNER;
+		double prev = -INFINITY;
+
+		for (int j = 0; j < m; j++) {
+			double score = -INFINITY;
+			if (tolower(needle[i]) == tolower(haystack[j])) {
+				double bonus = reference_bonus(j ? haystack[j - 1] : '/', haystack[j]);
+				if (!i) {
+					score = j * SCORE_GAP_LEADING + bonus;
+				} else if (j) {
+					score = max(last_M[j - 1] + bonus,
+						    last_D[j - 1] + SCORE_MATCH_CONSECUTIVE);
+				}
+			}
+			curr_D[j] = score;
+			curr_M[j] = prev = max(score, prev + gap);
+		}
+	}
+
+	return M[(n - 1) % 2][m - 1];
+}
+
+static theft_trial_res prop_match_should_equal_reference(char *needle, char *haystack) {
+	if (!has_match(needle, haystack))
+		return THEFT_TRIAL_SKIP;
+
+	double expected = reference_match(needle, haystack);
+	double actual = SCORE_TO_DOUBLE(match(needle, haystack));
+
+	if (isinf(expected) ? actual != expected : (actual > expected ? actual - expected : expected - actual) > 0.000001)
+		return THEFT_TRIAL_FAIL;
+
+	return THEFT_TRIAL_PASS;
+}
+
+TEST match_should_equal_reference() {
+	struct theft *t = theft_init(0);
+	struct theft_cfg cfg = {
+	    .name = __func__,
+	    .fun = prop_match_should_equal_reference,
+	    .type_info = {&string_info, &string_info},
+	    .trials = 100000,
+	};
+
+	theft_run_res res = theft_run(t, &cfg);
+	theft_free(t);
+	GREATEST_ASSERT_EQm("match_should_equal_reference", THEFT_RUN_PASS, res);
+	PASS();
+}
+
+static theft_trial_res prop_upper_bound_should_not_be_less_than_score(char *needle, char *haystack) {
+	if (!has_match(needle, haystack))
+		return THEFT_TRIAL_SKIP;
+
+	size_t len = strlen(haystack);
+	char *prepared = malloc(MATCH_PREPARED_SIZE(len));
+	match_prepare(haystack, len, prepared);
+
+	theft_trial_res res = THEFT_TRIAL_PASS;
+	query_t query;
+	query_init(&query, needle);
+	if (match_upper_bound(&query, prepared) < match(needle, haystack))
+		res = THEFT_TRIAL_FAIL;
+	query_destroy(&query);
+
+	/* Also try a needle which is likely to be scored */
+	char prefix[3] = {haystack[0], haystack[0] ? haystack[1] : '\0', '\0'};
+	query_init(&query, prefix);
+	if (match_upper_bound(&query, prepared) < match(prefix, haystack))
+		res = THEFT_TRIAL_FAIL;
+	query_destroy(&query);
+
+	free(prepared);
+	return res;
+}
+
+TEST upper_bound_should_not_be_less_than_score() {
+	struct theft *t = theft_init(0);
+	struct theft_cfg cfg = {
+	    .name = __func__,
+	    .fun = prop_upper_bound_should_not_be_less_than_score,
+	    .type_info = {&string_info, &string_info},
+	    .trials = 100000,
+	};
+
+	theft_run_res res = theft_run(t, &cfg);
+	theft_free(t);
+	GREATEST_ASSERT_EQm("upper_bound_should_not_be_less_than_score", THEFT_RUN_PASS, res);
+	PASS();
+}
+
+static theft_trial_res prop_match_extend_should_equal_match(char *needle, char *haystack) {
+	size_t len = strlen(haystack);
+	if (len > MATCH_MAX_LEN)
+		return THEFT_TRIAL_SKIP;
+
+	/* A needle which matches, so that each of its prefixes is scored */
+	char subsequence[MATCH_MAX_LEN + 1];
+	size_t step = 1 + (unsigned char)needle[0] % 3;
+	size_t n = 0;
+	for (size_t j = 0; j < len; j += step)
+		subsequence[n++] = haystack[j];
+	subsequence[n] = '\0';
+
+	char *prepared = malloc(MATCH_PREPARED_SIZE(len));
+	score_t *buf = malloc(2 * MATCH_ROWS_SIZE(len) * sizeof(score_t));
+	score_t *rows = buf, *last_rows = buf + MATCH_ROWS_SIZE(len);
+	match_prepare(haystack, len, prepared);
+
+	theft_trial_res res = THEFT_TRIAL_PASS;
+	for (size_t k = 1; k <= n; k++) {
+		char c = subsequence[k];
+		subsequence[k] = '\0';
+
+		query_t query;
+		query_init(&query, subsequence);
+		score_t expected = match(subsequence, haystack);
+		score_t extended = match_extend(&query, prepared, k > 1 ? last_rows : NULL, rows);
+		score_t from_scratch = match_extend(&query, prepared, NULL, last_rows);
+		if (extended != expected || from_scratch != expected)
+			res = THEFT_TRIAL_FAIL;
+		query_destroy(&query);
+
+		/* The next prefix carries on from the extended rows */
+		score_t *tmp = last_rows;
+		last_rows = rows;
+		rows = tmp;
+
+		subsequence[k] = c;
+	}
+
+	free(prepared);
+	free(buf);
+	return res;
+}
+
+TEST match_extend_should_equal_match() {
+	struct theft *t = theft_init(0);
+	struct theft_cfg cfg = {
+	    .name = __func__,
+	    .fun = prop_match_extend_should_equal_match,
+	    .type_info = {&string_info, &string_info},
+	    .trials = 10000,
+	};
+
+	theft_run_res res = theft_run(t, &cfg);
+	theft_free(t);
+	GREATEST_ASSERT_EQm("match_extend_should_equal_match", THEFT_RUN_PASS, res);
+	PASS();
+}
+
 SUITE(properties_suite) {
 	RUN_TEST(should_return_results_if_there_is_a_match);
 	RUN_TEST(positions_should_match_characters_in_string);
+	RUN_TEST(has_match_should_equal_reference);
+	RUN_TEST(match_batch_should_equal_match);
+	RUN_TEST(match_should_equal_reference);
+	RUN_TEST(upper_bound_should_not_be_less_than_score);
+	RUN_TEST(match_extend_should_equal_match);
 }